@@ -0,0 +1,43 @@
+#!/bin/sh
+# Runs the distributed training with local processes, which is mostly
+# useful for testing. The treebanks are dealt out to the workers in turn.
+#
+#   train/distributed.sh <grammar> <number of workers> <lang> <files> ...
+
+if [ $# -lt 4 ]; then
+	echo "Syntax: $0 <grammar> <number of workers> <lang> <files> ..." >&2
+	exit 1
+fi
+
+GRAMMAR=$1
+N=$2
+LANG=$3
+shift 3
+
+DIR=$(mktemp -d /tmp/udsenser.XXXXXX) || exit 1
+trap 'kill $PIDS 2>/dev/null; rm -rf "$DIR"' EXIT
+
+PIDS=""
+i=0
+while [ $i -lt $N ]; do
+	FILES=""
+	j=0
+	for f in "$@"; do
+		if [ $((j % N)) -eq $i ]; then
+			FILES="$FILES $f"
+		fi
+		j=$((j+1))
+	done
+	if [ -z "$FILES" ]; then
+		echo "There are fewer files than workers" >&2
+		exit 1
+	fi
+	build/udsenser "$GRAMMAR" worker "$DIR" $i $LANG $FILES &
+	PIDS="$PIDS $!"
+	i=$((i+1))
+done
+
+build/udsenser "$GRAMMAR" coordinate "$DIR" $N
+STATUS=$?
+wait $PIDS
+exit $STATUS
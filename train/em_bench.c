@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <gu/mem.h>
+#include <gu/map.h>
+#include <gu/exn.h>
+#include "em_core.h"
+
+// A benchmark for the EM core. It builds either a synthetic forest
+// with controllable shape or imports a CoNLL-U treebank and then
+// times the import, the EM steps, the dumping of the model and
+// the annotation. The number of threads is fixed at compile time,
+// so there is one binary per thread count (see the bench target
+// in the Makefile). The lexicon is either a grammar or a TSV file
+// in the format of em_read_tsv_lexicon. When compiled with
+// -DEM_NO_PGF only the latter works.
+
+typedef struct {
+	size_t n_trees;
+	size_t depth;
+	size_t fanout;
+	size_t ambiguity;
+	size_t iterations;
+	uint64_t seed;
+	size_t region_size;
+	size_t max_elem_size;
+	size_t max_resident;
+	bool compact;
+	bool dedup;
+	GuString conllu;
+	GuString lang;
+} BenchConfig;
+
+typedef struct {
+	GuMapItor clo;
+	EMLexicon* lex;
+	GuBuf* funs;
+} LexicalItor;
+
+static void
+collect_lexical(GuMapItor* clo, const void* key, void* value, GuExn* err)
+{
+	LexicalItor* self = gu_container(clo, LexicalItor, clo);
+	PgfCId fun = (PgfCId) key;
+
+	size_t arity;
+	PgfCId cat = self->lex->function_cat(self->lex, fun, &arity);
+	if (cat != NULL && arity == 0)
+		gu_buf_push(self->funs, PgfCId, fun);
+}
+
+static uint64_t
+bench_random(uint64_t* seed)
+{
+	// xorshift64*, good enough and reproducible everywhere
+	uint64_t x = *seed;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*seed = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double
+bench_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+typedef struct {
+	EMState* state;
+	BenchConfig* config;
+	GuBuf* funs;
+	uint64_t seed;
+	size_t index;
+	size_t n_edges;
+} TreeGen;
+
+static DepTree*
+gen_dep_tree(TreeGen* gen, DepTree* parent, size_t depth)
+{
+	size_t n_children = 0;
+	if (depth < gen->config->depth)
+		n_children = bench_random(&gen->seed) % (gen->config->fanout+1);
+
+	size_t n_funs = 1 + bench_random(&gen->seed) % gen->config->ambiguity;
+	PgfCId funs[n_funs];
+	for (size_t i = 0; i < n_funs; i++) {
+		size_t n_lexical = gu_buf_length(gen->funs);
+		funs[i] = gu_buf_get(gen->funs, PgfCId,
+		                     bench_random(&gen->seed) % n_lexical);
+		for (size_t j = 0; j < i; j++) {
+			if (funs[i] == funs[j]) {
+				n_funs = i;
+				break;
+			}
+		}
+	}
+
+	DepTree* dtree =
+		em_new_dep_tree_choices(gen->state, parent, funs, n_funs, "dep",
+		                        gen->index++, n_children);
+	for (size_t i = 0; i < n_children; i++) {
+		dtree->children[i] = gen_dep_tree(gen, dtree, depth+1);
+	}
+	gen->n_edges += n_children;
+	return dtree;
+}
+
+static size_t
+count_sentences(GuString fpath)
+{
+	FILE* inp = fopen(fpath, "r");
+	if (inp == NULL)
+		return 0;
+
+	size_t n_sentences = 0;
+	char line[BUFSIZ];
+	while (fgets(line, sizeof(line), inp)) {
+		if (line[0] == '\n')
+			n_sentences++;
+	}
+
+	fclose(inp);
+	return n_sentences;
+}
+
+static void
+report(BenchConfig* config, const char* phase,
+       size_t n_trees, size_t n_edges, double time)
+{
+	printf("%-10s threads=%d trees=%zu edges=%zu time=%.3fs trees/s=%.0f edges/s=%.0f\n",
+	       phase, NUM_THREADS, n_trees, n_edges, time,
+	       n_trees/time, n_edges/time);
+}
+
+static void
+usage()
+{
+	fprintf(stderr,
+	        "Syntax: em_bench <grammar.pgf or lexicon.tsv>\n"
+	        "                 [--trees N] [--depth N] [--fanout N]\n"
+	        "                 [--ambiguity N] [--iterations N] [--seed N]\n"
+	        "                 [--region-size N] [--max-elem-size N] [--max-resident N]\n"
+	        "                 [--compact] [--dedup]\n"
+	        "                 [--conllu <file> --lang <concr syntax>]\n");
+	exit(1);
+}
+
+int
+main(int argc, char* argv[])
+{
+	BenchConfig config;
+	config.n_trees    = 100000;
+	config.depth      = 4;
+	config.fanout     = 3;
+	config.ambiguity  = 4;
+	config.iterations = 10;
+	config.seed       = 42;
+	config.region_size   = 64*1024*1024;
+	config.max_elem_size = 16*1024;
+	config.max_resident  = 0;
+	config.compact       = false;
+	config.dedup         = false;
+	config.conllu     = NULL;
+	config.lang       = NULL;
+
+	if (argc < 2)
+		usage();
+
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "--compact") == 0) {
+			config.compact = true;
+			continue;
+		}
+		if (strcmp(argv[i], "--dedup") == 0) {
+			config.dedup = true;
+			continue;
+		}
+
+		if (i+1 >= argc)
+			usage();
+
+		if (strcmp(argv[i], "--trees") == 0)
+			config.n_trees = atol(argv[++i]);
+		else if (strcmp(argv[i], "--depth") == 0)
+			config.depth = atol(argv[++i]);
+		else if (strcmp(argv[i], "--fanout") == 0)
+			config.fanout = atol(argv[++i]);
+		else if (strcmp(argv[i], "--ambiguity") == 0)
+			config.ambiguity = atol(argv[++i]);
+		else if (strcmp(argv[i], "--iterations") == 0)
+			config.iterations = atol(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0)
+			config.seed = atol(argv[++i]);
+		else if (strcmp(argv[i], "--region-size") == 0)
+			config.region_size = atol(argv[++i]);
+		else if (strcmp(argv[i], "--max-elem-size") == 0)
+			config.max_elem_size = atol(argv[++i]);
+		else if (strcmp(argv[i], "--max-resident") == 0)
+			config.max_resident = atol(argv[++i]);
+		else if (strcmp(argv[i], "--conllu") == 0)
+			config.conllu = argv[++i];
+		else if (strcmp(argv[i], "--lang") == 0)
+			config.lang = argv[++i];
+		else
+			usage();
+	}
+
+	if (config.ambiguity == 0 || config.seed == 0)
+		usage();
+	if (config.conllu != NULL && config.lang == NULL)
+		usage();
+
+	GuPool* pool = gu_new_pool();
+	GuExn* err = gu_new_exn(pool);
+
+	EMLexicon* lex = em_open_lexicon(argv[1], pool, err);
+	if (gu_exn_is_raised(err)) {
+		fprintf(stderr, "Reading %s failed\n", argv[1]);
+		return 1;
+	}
+
+	EMState* state = em_new_state_lexicon(lex, 1, 0.002);
+	if (state == NULL) {
+		fprintf(stderr, "Creating the EM state failed\n");
+		return 1;
+	}
+
+	if (!em_configure_data_stream(state, config.region_size,
+	                              config.max_elem_size, config.max_resident)) {
+		fprintf(stderr, "Invalid data stream configuration\n");
+		return 1;
+	}
+
+	em_set_import_options(state, (config.compact ? EM_OPT_COMPACT : 0) |
+	                             (config.dedup   ? EM_OPT_DEDUP   : 0));
+
+	LexicalItor itor;
+	itor.clo.fn = collect_lexical;
+	itor.lex    = lex;
+	itor.funs   = gu_new_buf(PgfCId, pool);
+	lex->iter_functions(lex, &itor.clo, NULL);
+	if (gu_buf_length(itor.funs) == 0) {
+		fprintf(stderr, "The lexicon has no lexical functions\n");
+		return 1;
+	}
+
+	TreeGen gen;
+	gen.state   = state;
+	gen.config  = &config;
+	gen.funs    = itor.funs;
+	gen.seed    = config.seed;
+	gen.index   = 0;
+	gen.n_edges = 0;
+
+	// Import
+	size_t n_trees, n_edges;
+	double t = bench_clock();
+	if (config.conllu != NULL) {
+		if (!em_import_treebank(state, config.conllu, config.lang))
+			return 1;
+		n_trees = count_sentences(config.conllu);
+		n_edges = em_bigram_count(state);
+	} else {
+		for (size_t i = 0; i < config.n_trees; i++) {
+			em_start_dep_tree(state);
+			gen.index = 0;
+			em_add_dep_tree(state, gen_dep_tree(&gen, NULL, 0));
+		}
+		n_trees = config.n_trees;
+		n_edges = gen.n_edges;
+	}
+	report(&config, "import", n_trees, n_edges, bench_clock()-t);
+	if (config.compact)
+		printf("compacted  nodes=%zu\n", em_compacted_count(state));
+	if (config.dedup)
+		printf("dedup      trees=%zu\n", em_duplicate_count(state));
+
+	// EM steps
+	t = bench_clock();
+	for (size_t i = 0; i < config.iterations; i++) {
+		em_step(state);
+	}
+	double step_time = (bench_clock()-t) / config.iterations;
+	report(&config, "step", n_trees, n_edges, step_time);
+
+	// Dump
+	char unigram_path[] = "/tmp/em_bench_unigram_XXXXXX";
+	char bigram_path[]  = "/tmp/em_bench_bigram_XXXXXX";
+	close(mkstemp(unigram_path));
+	close(mkstemp(bigram_path));
+	t = bench_clock();
+	em_dump(state, unigram_path, bigram_path);
+	report(&config, "dump", n_trees, n_edges, bench_clock()-t);
+	remove(unigram_path);
+	remove(bigram_path);
+
+	// Annotation, which needs the complete trees
+	if (!config.compact && !config.dedup) {
+		t = bench_clock();
+		em_export_abstract_treebank(state, "/dev/null");
+		report(&config, "annotate", n_trees, n_edges, bench_clock()-t);
+	}
+
+	em_free_state(state);
+	gu_pool_free(pool);
+	return 0;
+}
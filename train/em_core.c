@@ -1,9 +1,15 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
+#include <inttypes.h>
 #include <math.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <gu/string.h>
 #include <gu/mem.h>
 #include <gu/seq.h>
@@ -11,7 +17,6 @@
 #include <gu/string.h>
 #include <gu/ucs.h>
 #include <gu/utf8.h>
-#include <pgf/pgf.h>
 #include "em_core.h"
 #include "em_data_stream.h"
 #include <time.h>
@@ -22,6 +27,10 @@
 #include <lzma.h>
 #endif
 
+#ifdef EM_NUMA
+#include <numa.h>
+#endif
+
 typedef struct {
 	EMState* state;
 	size_t thread_idx;
@@ -34,21 +43,55 @@ typedef struct {
 	// The inside probability of a dtree when the root has
 	// the j-th sense is inside_probs[dtree->index][j].
 	// inside_probs[dtree->index] points into the estimates array.
-	// The sizes of the two arrays are in state->max_tree_index and
-	// state->max_tree_choices
+	// The sizes of the two arrays are in n_inside_probs and
+	// n_estimates_cap, see em_reserve_scratch.
 	prob_t** inside_probs;
 	prob_t*  estimates;
+	size_t n_inside_probs;
+	size_t n_estimates_cap;
+
+	// The outside probabilities during the counting. They are
+	// at the same offsets as the inside probabilities in estimates.
+	prob_t*  outside_estimates;
+
+	// -log of the number of copies of the current tree
+	prob_t weight;
+
+#ifdef EM_NUMA
+	// The counts of the current step by ProbCount id. They are added
+	// to the shared ProbCounts once at the end of the step, so that
+	// the threads do not write to the same cache lines all the time.
+	prob_t* counts;
+	size_t n_counts;
+#endif
+
+	// The scratch buffers are allocated here. The workers create
+	// their own pool, so that the memory is local to the thread.
+	GuPool* pool;
+
+	EMThreadStats stats;
 } EMThreadState;
 
+// Work for the pool of threads in EMState. Every thread calls run
+// once with its own state, and the threads split the work among
+// themselves, usually by taking batches with an atomic counter.
+typedef struct EMTask EMTask;
+
+struct EMTask {
+	void (*run)(EMTask* task, EMThreadState* tstate);
+};
+
 struct EMState {
 	GuPool* pool;
 	GuExn* err;
 	EMDataStream* stream;
 
-	PgfPGF *pgf;
+	EMLexicon *lex;
 	GuMap* stats;
+	GuBuf* funs;
 	size_t max_tree_index;
 	size_t max_tree_choices;
+	size_t n_tree_choices;
 	size_t bigram_total;
 	size_t unigram_total;
 	prob_t bigram_smoothing;
@@ -56,12 +99,37 @@ struct EMState {
 	GuBuf* pcs;
 	GuMap* callbacks;
 
+	int options;
+	size_t n_compacted;
+	size_t n_duplicates;
+	GuMap* dedup;  // the key of a tree -> the number of its copies
+	GuBuf* fixed_unigrams;  // the ProbCounts with n_fixed > 0
+	GuBuf* fixed_bigrams;
+
+	prob_t corpus_prob;
+	uint64_t step_time;
+
+	// The pool of threads. The tasks start after barrier1 and end
+	// with barrier3. barrier2 is free for the tasks to synchronize
+	// the threads in between. Only one task runs at a time.
 	bool finished;
-	size_t index1, index2;
+	EMTask* task;
+	pthread_mutex_t task_lock;
 	pthread_barrier_t barrier1, barrier2, barrier3;
 	EMThreadState threads[NUM_THREADS];
 };
 
+// The elements of the data stream
+typedef struct {
+	DepTree* dtree;
+	size_t* weight;  // the number of copies or NULL, see EM_OPT_DEDUP
+} StreamTree;
+
+// Only the trees with short keys are deduplicated. These are
+// the short sentences which are most likely to be repeated, and
+// this bounds the memory for the keys.
+#define EM_DEDUP_MAX_KEY 256
+
 #ifdef DEBUG
 static void
 print_tree(DepTree* dtree)
@@ -85,7 +153,117 @@ print_tree(DepTree* dtree)
 #endif
 
 static void *
-em_learner(void *arguments);
+em_worker(void *arguments);
+
+static uint64_t
+em_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+static void
+em_init_thread_state(EMThreadState* tstate, EMState* state, size_t thread_idx)
+{
+	tstate->state = state;
+	tstate->thread_idx = thread_idx;
+	tstate->prob = 0;
+	tstate->n_estimates = 0;
+	tstate->inside_probs = NULL;
+	tstate->estimates = NULL;
+	tstate->n_inside_probs = 0;
+	tstate->n_estimates_cap = 0;
+	tstate->outside_estimates = NULL;
+	tstate->weight = 0;
+#ifdef EM_NUMA
+	tstate->counts = NULL;
+	tstate->n_counts = 0;
+#endif
+	tstate->pool = NULL;
+	memset(&tstate->stats, 0, sizeof(EMThreadStats));
+}
+
+// Makes the scratch buffers of a thread large enough for trees
+// with indices up to max_index and with up to max_choices choices.
+// Since the buffers only grow, this is rare after the first call.
+static void
+em_reserve_scratch(EMThreadState* tstate,
+                   size_t max_index, size_t max_choices, GuPool* pool)
+{
+	if (tstate->n_inside_probs < max_index+1) {
+		tstate->inside_probs   = gu_new_n(prob_t*, max_index+1, pool);
+		tstate->n_inside_probs = max_index+1;
+	}
+	if (tstate->n_estimates_cap < max_choices+1) {
+		tstate->estimates         = gu_new_n(prob_t, max_choices+1, pool);
+		tstate->outside_estimates = gu_new_n(prob_t, max_choices+1, pool);
+		tstate->n_estimates_cap   = max_choices+1;
+	}
+}
+
+static void *
+em_worker(void *arguments)
+{
+	EMThreadState* tstate = (EMThreadState *) arguments;
+	EMState* state = tstate->state;
+
+#ifdef EM_NUMA
+	// Spread the workers evenly over the nodes and
+	// allocate their memory on the local node.
+	if (numa_available() >= 0) {
+		int n_nodes = numa_num_configured_nodes();
+		numa_run_on_node(tstate->thread_idx * n_nodes / NUM_THREADS);
+		numa_set_localalloc();
+	}
+#endif
+
+	// The pool is kept in a local variable since the state
+	// may already be freed when the loop ends.
+	GuPool* pool = gu_new_pool();
+	tstate->pool = pool;
+
+	for (;;) {
+		pthread_barrier_wait(&state->barrier1);
+
+		if (state->finished)
+			break;
+
+		em_reserve_scratch(tstate,
+		                   state->max_tree_index, state->max_tree_choices,
+		                   tstate->pool);
+
+		state->task->run(state->task, tstate);
+
+		pthread_barrier_wait(&state->barrier3);
+	}
+
+	gu_pool_free(pool);
+	return NULL;
+}
+
+// Runs the task on all threads and waits until they are done
+static void
+em_run_task(EMState* state, EMTask* task)
+{
+	pthread_mutex_lock(&state->task_lock);
+
+	state->task = task;
+	pthread_barrier_wait(&state->barrier1);
+	pthread_barrier_wait(&state->barrier3);
+	state->task = NULL;
+
+	pthread_mutex_unlock(&state->task_lock);
+}
+
+// Every ProbCount which is normalized in em_step is in the list
+// of counts. The others have id SIZE_MAX.
+static void
+add_prob_count(EMState* state, ProbCount* pc)
+{
+	pc->id = gu_buf_length(state->pcs);
+	gu_buf_push(state->pcs, ProbCount*, pc);
+}
 
 typedef struct {
 	GuMapItor clo;
@@ -102,13 +280,17 @@ function_iter(GuMapItor* clo, const void* key, void* value, GuExn* err)
 	FunStats **stats =
 		gu_map_insert(self->state->stats, fun);
 	if (*stats == NULL) {
-		PgfType* ty = pgf_function_type(self->state->pgf, fun);
+		EMLexicon* lex = self->state->lex;
+
+		size_t arity = 0;
+		lex->function_cat(lex, fun, &arity);
 
 		*stats = gu_new(FunStats, self->state->pool);
 		(*stats)->fun = fun;
-		(*stats)->pc.prob  =
-			pgf_category_prob(self->state->pgf, ty->cid) +
-			pgf_function_prob(self->state->pgf, fun);
+		(*stats)->id  = gu_buf_length(self->state->funs);
+		gu_buf_push(self->state->funs, FunStats*, *stats);
+		(*stats)->pc.prob  = lex->function_prob(lex, fun);
+		(*stats)->pc.n_fixed = 0;
 
 		(*stats)->mods =
 			gu_new_string_map(ProbCount*, NULL, self->state->pool);
@@ -117,19 +299,18 @@ function_iter(GuMapItor* clo, const void* key, void* value, GuExn* err)
 			(*stats)->pc.count[i] = INFINITY;
 		}
 
-		if (gu_seq_length(ty->hypos) == 0)
-			gu_buf_push(self->state->pcs, ProbCount*, &(*stats)->pc);
+		(*stats)->pc.id = SIZE_MAX;
+		if (arity == 0)
+			add_prob_count(self->state, &(*stats)->pc);
 
 		self->state->unigram_total += exp(-self->state->unigram_smoothing);
 	}	
 }
 
-EMState*
-em_new_state(PgfPGF* pgf,
-             prob_t unigram_smoothing, prob_t bigram_smoothing)
+static EMState*
+em_new_state_(GuPool* pool, EMLexicon* lex,
+              prob_t unigram_smoothing, prob_t bigram_smoothing)
 {
-	GuPool* pool        = gu_new_pool();
-
 	EMState* state = gu_new(EMState, pool);
 	state->pool   = pool;
 	state->err    = gu_new_exn(pool);
@@ -139,8 +320,10 @@ em_new_state(PgfPGF* pgf,
 		return NULL;
 	}
 	state->stats  = gu_new_string_map(FunStats*, NULL, pool);
+	state->funs   = gu_new_buf(FunStats*, pool);
 	state->max_tree_index = 0;
 	state->max_tree_choices = 0;
+	state->n_tree_choices = 0;
 	state->bigram_total = 0;
 	state->unigram_total = 0;
 	state->unigram_smoothing = -log(unigram_smoothing);
@@ -148,24 +331,40 @@ em_new_state(PgfPGF* pgf,
 	state->pcs = gu_new_buf(ProbCount*, pool);
 
 	state->callbacks = gu_new_string_map(EMRankingCallback, &gu_null_struct, pool);
-	state->pgf = pgf;
+	state->options = 0;
+	state->n_compacted = 0;
+	state->n_duplicates = 0;
+	state->dedup = gu_new_string_map(size_t*, NULL, pool);
+	state->fixed_unigrams = gu_new_buf(ProbCount*, pool);
+	state->fixed_bigrams  = gu_new_buf(ProbCount*, pool);
+	state->lex = lex;
 
 	FunctionItor itor;
 	itor.clo.fn  = function_iter;
 	itor.state = state;
-	pgf_iter_functions(state->pgf, &itor.clo, NULL);
+	lex->iter_functions(lex, &itor.clo, NULL);
+
+	state->corpus_prob = 0;
+	state->step_time = 0;
 
 	state->finished = false;
-	state->index1 = 0;
-	state->index2 = 0;
+	state->task = NULL;
+
+	if (pthread_mutex_init(&state->task_lock, NULL) != 0) {
+		em_data_stream_close(state->stream, state->err);
+		gu_pool_free(pool);
+		return NULL;
+	}
 
 	if (pthread_barrier_init(&state->barrier1, NULL, NUM_THREADS+1) != 0) {
+		pthread_mutex_destroy(&state->task_lock);
 		em_data_stream_close(state->stream, state->err);
 		gu_pool_free(pool);
 		return NULL;
 	}
 
 	if (pthread_barrier_init(&state->barrier2, NULL, NUM_THREADS) != 0) {
+		pthread_mutex_destroy(&state->task_lock);
 		pthread_barrier_destroy(&state->barrier1);
 		em_data_stream_close(state->stream, state->err);
 		gu_pool_free(pool);
@@ -173,6 +372,7 @@ em_new_state(PgfPGF* pgf,
 	}
 
 	if (pthread_barrier_init(&state->barrier3, NULL, NUM_THREADS+1) != 0) {
+		pthread_mutex_destroy(&state->task_lock);
 		pthread_barrier_destroy(&state->barrier1);
 		pthread_barrier_destroy(&state->barrier2);
 		em_data_stream_close(state->stream, state->err);
@@ -180,29 +380,59 @@ em_new_state(PgfPGF* pgf,
 		return NULL;
 	}
 
-	//create all learning threads one by one
+	//create all worker threads one by one
 	for (size_t i = 0; i < NUM_THREADS; i++) {
 		pthread_t thread_id;
 
-		state->threads[i].state = state;
-		state->threads[i].thread_idx = i;
-		state->threads[i].prob = 0;
-		state->threads[i].inside_probs = NULL;
-		state->threads[i].estimates = NULL;
+		em_init_thread_state(&state->threads[i], state, i);
 
 		int result_code =
-			pthread_create(&thread_id, NULL, em_learner,
+			pthread_create(&thread_id, NULL, em_worker,
 			               &state->threads[i]);
 		gu_assert(!result_code);
 
 		char name[16];
-		sprintf(name, "em_learner %ld", i);
+		sprintf(name, "em_worker %ld", i);
 		pthread_setname_np(thread_id, name);
 	}
 
 	return state;
 }
 
+#ifndef EM_NO_PGF
+EMState*
+em_new_state(PgfPGF* pgf,
+             prob_t unigram_smoothing, prob_t bigram_smoothing)
+{
+	GuPool* pool = gu_new_pool();
+	return em_new_state_(pool, em_new_pgf_lexicon(pgf, pool),
+	                     unigram_smoothing, bigram_smoothing);
+}
+#endif
+
+EMState*
+em_new_state_lexicon(EMLexicon* lex,
+                     prob_t unigram_smoothing, prob_t bigram_smoothing)
+{
+	return em_new_state_(gu_new_pool(), lex,
+	                     unigram_smoothing, bigram_smoothing);
+}
+
+int
+em_configure_data_stream(EMState *state,
+                         size_t region_size, size_t max_elem_size,
+                         size_t max_resident)
+{
+	em_data_stream_configure(state->stream,
+	                         region_size, max_elem_size, max_resident,
+	                         state->err);
+	if (gu_exn_is_raised(state->err)) {
+		gu_exn_clear(state->err);
+		return 0;
+	}
+	return 1;
+}
+
 void
 em_free_state(EMState* state)
 {
@@ -210,6 +440,7 @@ em_free_state(EMState* state)
 
 	pthread_barrier_wait(&state->barrier1);
 
+	pthread_mutex_destroy(&state->task_lock);
 	pthread_barrier_destroy(&state->barrier1);
 	pthread_barrier_destroy(&state->barrier2);
 	pthread_barrier_destroy(&state->barrier3);
@@ -225,8 +456,6 @@ typedef struct {
 	GuString value[CONLL_NUM_FIELDS];
 } CONLLFields;
 
-typedef prob_t (*Oper)(prob_t x, prob_t y);
-
 static prob_t
 log_add(prob_t x, prob_t y)
 {
@@ -247,17 +476,15 @@ log_max(prob_t x, prob_t y)
 }
 
 static prob_t
-get_pgf_prob(EMState* state, PgfCId fun)
+get_lexicon_prob(EMState* state, PgfCId fun)
 {
-	PgfType* ty =
-		pgf_function_type(state->pgf, fun);
-	if (ty == NULL) {
+	prob_t prob = state->lex->function_prob(state->lex, fun);
+	if (prob == INFINITY) {
 		printf("Unknown function %s\n", fun);
 		exit(1);
 	}
 
-	return pgf_category_prob(state->pgf, ty->cid) +
-	       pgf_function_prob(state->pgf, fun);
+	return prob;
 }
 
 static void
@@ -291,15 +518,16 @@ init_counts(EMState* state, DepTree* dtree,
 				gu_map_insert(parent_choice->stats->mods, choice->stats->fun);
 			if (*pc == NULL) {
 				prob_t back_off =
-					get_pgf_prob(state,parent_choice->stats->fun) +
-					get_pgf_prob(state,choice->stats->fun);
+					get_lexicon_prob(state,parent_choice->stats->fun) +
+					get_lexicon_prob(state,choice->stats->fun);
 
 				*pc = gu_new(ProbCount, state->pool);
 				(*pc)->prob  = state->bigram_smoothing + back_off;
+				(*pc)->n_fixed = 0;
 				for (size_t i = 0; i < NUM_THREADS; i++) {
 					(*pc)->count[i] = INFINITY;
 				}
-				gu_buf_push(state->pcs, ProbCount*, *pc);
+				add_prob_count(state, *pc);
 			}
 
 			choice->prob_counts[j] = *pc;
@@ -323,11 +551,13 @@ filter_dep_tree(EMState* state, DepTree* dtree, GuSeq* conll,
 	int max[2] = {INT_MIN, INT_MAX};
 	int stats[n_lemmas][2];
 	for (size_t i = 0; i < n_lemmas; i++) {
-		PgfCId fun  = gu_buf_get(fields->lemmas, PgfCId, i);
-		PgfType* ty = pgf_function_type(state->pgf, fun);
+		PgfCId fun = gu_buf_get(fields->lemmas, PgfCId, i);
+
+		size_t arity;
+		PgfCId cat = state->lex->function_cat(state->lex, fun, &arity);
 
 		EMRankingCallback callback =
-			gu_map_get(state->callbacks, ty->cid, EMRankingCallback);
+			gu_map_get(state->callbacks, cat, EMRankingCallback);
 		if (callback != NULL) {
 			callback(fun, conll, dtree, stats[i]);
 		} else {
@@ -374,7 +604,7 @@ filter_dep_tree(EMState* state, DepTree* dtree, GuSeq* conll,
 }
 
 static DepTree*
-build_dep_tree(EMState* state, PgfConcr* concr,
+build_dep_tree(EMState* state,
                GuSeq* conll, size_t index, CONLLFields* fields)
 {
 	GuString id = fields->value[0];
@@ -403,8 +633,7 @@ build_dep_tree(EMState* state, PgfConcr* concr,
 		CONLLFields* fields = gu_seq_index(conll, CONLLFields, i);
 		if (strcmp(fields->value[6],id) == 0) {
 			dtree->children[pos++] = 
-				build_dep_tree(state, concr,
-							   conll, i, fields);
+				build_dep_tree(state, conll, i, fields);
 			state->bigram_total++;
 		}
 		}
@@ -416,54 +645,41 @@ DepTree*
 em_new_dep_tree(EMState* state, DepTree* parent,
                 PgfCId fun, GuString lbl,
                 size_t index, size_t n_children)
+{
+	return em_new_dep_tree_choices(state, parent, &fun, 1, lbl,
+	                               index, n_children);
+}
+
+DepTree*
+em_new_dep_tree_choices(EMState* state, DepTree* parent,
+                        PgfCId* funs, size_t n_funs, GuString lbl,
+                        size_t index, size_t n_children)
 {
 	DepTree* dtree = em_data_stream_malloc(state->stream,
 	                                       GU_FLEX_SIZE(DepTree, children, n_children));
 	dtree->index      = index;
-	dtree->n_choices  = 1;
-	dtree->choices    = em_data_stream_malloc(state->stream,sizeof(SenseChoice));
+	dtree->n_choices  = n_funs;
+	dtree->choices    = em_data_stream_malloc(state->stream,sizeof(SenseChoice)*n_funs);
 	dtree->n_children = n_children;
 
-	if (dtree->index > state->max_tree_index)
-		state->max_tree_index = dtree->index;
-	if (dtree->index+1 > state->max_tree_choices)
-		state->max_tree_choices = dtree->index+1;
-
-	SenseChoice* choice = &dtree->choices[0];
-
-	choice->stats =
-		gu_map_get(state->stats, fun, FunStats*);
-	assert(choice->stats != NULL);
-
-	choice->stats->pc.count[0] =
-		log_add(choice->stats->pc.count[0],0);
-
-	choice->prob_counts = em_data_stream_malloc(state->stream,
-	                                            sizeof(ProbCount*)*1);
-
-	if (parent != NULL) {
-		SenseChoice* parent_choice = &parent->choices[0];
-
-		ProbCount** pc =
-			gu_map_insert(parent_choice->stats->mods, choice->stats->fun);
-		if (*pc == NULL) {
-			prob_t back_off =
-				get_pgf_prob(state,parent_choice->stats->fun) +
-				get_pgf_prob(state,choice->stats->fun);
+	for (size_t i = 0; i < n_funs; i++) {
+		SenseChoice* choice = &dtree->choices[i];
 
-			*pc = gu_new(ProbCount, state->pool);
-			(*pc)->prob  = state->bigram_smoothing + back_off;
-			for (size_t i = 0; i < NUM_THREADS; i++) {
-				(*pc)->count[i] = INFINITY;
-			}
-			gu_buf_push(state->pcs, ProbCount*, *pc);
-		}
+		choice->prob_counts = NULL;
+		choice->stats =
+			gu_map_get(state->stats, funs[i], FunStats*);
+		assert(choice->stats != NULL);
+	}
 
-		choice->prob_counts[0] = *pc;
+	if (parent != NULL)
+		init_counts(state, dtree, parent->choices, parent->n_choices,
+		            &state->n_tree_choices);
+	else
+		init_counts(state, dtree, NULL, 0,
+		            &state->n_tree_choices);
 
-		choice->prob_counts[0]->count[0] =
-			log_add(choice->prob_counts[0]->count[0], 0);
-	}
+	if (state->max_tree_choices < state->n_tree_choices)
+		state->max_tree_choices = state->n_tree_choices;
 
 	state->unigram_total++;
 	state->bigram_total += n_children;
@@ -474,7 +690,7 @@ em_new_dep_tree(EMState* state, DepTree* parent,
 DepTree*
 em_new_conll_dep_tree(EMState* state, GuString lang, GuSeq* conll)
 {
-	PgfConcr* concr = pgf_get_language(state->pgf, lang);
+	EMLanguage* concr = state->lex->get_language(state->lex, lang);
 	if (concr == NULL)
 		return NULL;
 
@@ -485,8 +701,7 @@ em_new_conll_dep_tree(EMState* state, GuString lang, GuSeq* conll)
 		CONLLFields* fields = gu_seq_index(conll, CONLLFields, i);
 		if (strcmp(fields->value[6], "0") == 0) {
 			em_start_dep_tree(state);
-			dtree = build_dep_tree(state, concr,
-								   conll, i, fields);
+			dtree = build_dep_tree(state, conll, i, fields);
 			filter_dep_tree(state, dtree, conll,
 			                NULL, 0, &n_tree_choices);
 			break;
@@ -502,6 +717,8 @@ em_new_conll_dep_tree(EMState* state, GuString lang, GuSeq* conll)
 void
 em_start_dep_tree(EMState* state)
 {
+	state->n_tree_choices = 0;
+
 	em_data_stream_start_element(state->stream, state->err);
 	if (gu_exn_is_raised(state->err)) {
 		printf("em_start_dep_tree: i/o error\n");
@@ -509,10 +726,139 @@ em_start_dep_tree(EMState* state)
 	}
 }
 
+void
+em_set_import_options(EMState *state, int options)
+{
+	state->options = options;
+}
+
+size_t
+em_compacted_count(EMState* state)
+{
+	return state->n_compacted;
+}
+
+size_t
+em_duplicate_count(EMState* state)
+{
+	return state->n_duplicates;
+}
+
+static void
+add_fixed_count(GuBuf* fixed, ProbCount* pc)
+{
+	if (pc->n_fixed++ == 0)
+		gu_buf_push(fixed, ProbCount*, pc);
+}
+
+// Called for a node which is removed from the tree. Its own subtree
+// is already compacted. If the node has a single choice, it is chosen
+// with probability one. The same is true for the edge from the parent
+// when the parent also has a single choice.
+static void
+fix_dep_tree(EMState* state, DepTree* dtree, size_t n_parent_choices)
+{
+	if (dtree->n_choices == 1) {
+		SenseChoice* choice = &dtree->choices[0];
+		add_fixed_count(state->fixed_unigrams, &choice->stats->pc);
+		if (n_parent_choices == 1)
+			add_fixed_count(state->fixed_bigrams, choice->prob_counts[0]);
+	}
+	state->n_compacted++;
+}
+
+// Returns true if no node in the subtree has more than one choice.
+// The inside probability of such a subtree is the same for all choices
+// of the parent, unless the root of the subtree has a single choice and
+// the parent is ambiguous. Apart from that case the subtree does not
+// change the posteriors and it is removed. In the remaining case
+// only the node itself must stay. The probability of the removed edges
+// is added back to the corpus probability in every step.
+static bool
+compact_dep_tree(EMState* state, DepTree* dtree)
+{
+	bool fixed = (dtree->n_choices <= 1);
+
+	size_t n_children = 0;
+	for (size_t i = 0; i < dtree->n_children; i++) {
+		DepTree* child = dtree->children[i];
+		if (compact_dep_tree(state, child)) {
+			// the children of child are already removed
+			if (dtree->n_choices <= 1 || child->n_choices == 0) {
+				fix_dep_tree(state, child, dtree->n_choices);
+				continue;
+			}
+		} else {
+			fixed = false;
+		}
+		dtree->children[n_children++] = child;
+	}
+	dtree->n_children = n_children;
+
+	return fixed;
+}
+
+// Writes the structure and the choices of the tree in pre-order.
+// Returns false if the key does not fit.
+static bool
+dep_tree_key(DepTree* dtree, char** pkey, char* end)
+{
+	int n = snprintf(*pkey, end-*pkey, "%zu", dtree->n_children);
+	if (n < 0 || n >= end-*pkey)
+		return false;
+	*pkey += n;
+
+	for (size_t i = 0; i < dtree->n_choices; i++) {
+		n = snprintf(*pkey, end-*pkey, ",%zu", dtree->choices[i].stats->id);
+		if (n < 0 || n >= end-*pkey)
+			return false;
+		*pkey += n;
+	}
+
+	if (*pkey+1 >= end)
+		return false;
+	*(*pkey)++ = ';';
+	**pkey = 0;
+
+	for (size_t i = 0; i < dtree->n_children; i++) {
+		if (!dep_tree_key(dtree->children[i], pkey, end))
+			return false;
+	}
+	return true;
+}
+
 void
 em_add_dep_tree(EMState* state, DepTree* dtree)
 {
-	em_data_stream_add_element(state->stream, dtree);
+	if (state->options & EM_OPT_COMPACT)
+		compact_dep_tree(state, dtree);
+
+	size_t* weight = NULL;
+	if (state->options & EM_OPT_DEDUP) {
+		char key[EM_DEDUP_MAX_KEY];
+		char* p = key;
+		if (dep_tree_key(dtree, &p, key+sizeof(key))) {
+			size_t* copies = gu_map_get(state->dedup, key, size_t*);
+			if (copies != NULL) {
+				// the counts from init_counts stay, since they
+				// are per occurrence anyway
+				(*copies)++;
+				state->n_duplicates++;
+				em_data_stream_discard_element(state->stream);
+				return;
+			}
+
+			weight  = gu_new(size_t, state->pool);
+			*weight = 1;
+			gu_map_put(state->dedup, gu_string_copy(key, state->pool),
+			           size_t*, weight);
+		}
+	}
+
+	StreamTree* elem = em_data_stream_malloc(state->stream, sizeof(StreamTree));
+	elem->dtree  = dtree;
+	elem->weight = weight;
+	em_data_stream_add_element(state->stream, elem);
 }
 
 void
@@ -524,6 +870,132 @@ em_increment_count(EMState* state, PgfCId fun)
 	stats->pc.prob = log_add(stats->pc.prob, 0);
 }
 
+// Reads the trees produced by the Haskell side in one go.
+// See em_import_packed_trees in em_core.h for the format.
+typedef struct {
+	const uint8_t* p;
+	const uint8_t* end;
+	size_t index;
+} PackedReader;
+
+static PgfCId
+packed_fun(EMState* state, PackedReader* rdr)
+{
+	const uint8_t* nul = memchr(rdr->p, 0, rdr->end - rdr->p);
+	if (nul == NULL)
+		return NULL;
+
+	PgfCId fun = (PgfCId) rdr->p;
+	rdr->p = nul+1;
+
+	if (gu_map_get(state->stats, fun, FunStats*) == NULL) {
+		fprintf(stderr, "Unknown function %s\n", fun);
+		return NULL;
+	}
+
+	return fun;
+}
+
+static DepTree*
+packed_dep_tree(EMState* state, PackedReader* rdr, DepTree* parent)
+{
+	uint32_t n_children;
+	if (rdr->end - rdr->p < sizeof(n_children))
+		return NULL;
+	memcpy(&n_children, rdr->p, sizeof(n_children));
+	rdr->p += sizeof(n_children);
+
+	PgfCId fun = packed_fun(state, rdr);
+	if (fun == NULL)
+		return NULL;
+
+	// every child takes at least six bytes, which protects us
+	// from allocating huge nodes for corrupted input
+	if (n_children > (rdr->end - rdr->p) / 6)
+		return NULL;
+
+	DepTree* dtree =
+		em_new_dep_tree(state, parent, fun, "", rdr->index++, n_children);
+	for (size_t i = 0; i < n_children; i++) {
+		dtree->children[i] = packed_dep_tree(state, rdr, dtree);
+		if (dtree->children[i] == NULL)
+			return NULL;
+	}
+
+	return dtree;
+}
+
+int
+em_import_packed_trees(EMState* state, const uint8_t* buf, size_t len)
+{
+	PackedReader rdr;
+	rdr.p   = buf;
+	rdr.end = buf+len;
+
+	while (rdr.p < rdr.end) {
+		const uint8_t* item = rdr.p++;
+
+		switch (*item) {
+		case 'T': {
+			em_start_dep_tree(state);
+			rdr.index = 0;
+			DepTree* dtree = packed_dep_tree(state, &rdr, NULL);
+			if (dtree == NULL) {
+				fprintf(stderr, "Malformed tree at offset %zu\n", (size_t) (item-buf));
+				return 0;
+			}
+			em_add_dep_tree(state, dtree);
+			break;
+		}
+		case 'C': {
+			PgfCId fun = packed_fun(state, &rdr);
+			if (fun == NULL) {
+				fprintf(stderr, "Malformed count at offset %zu\n", (size_t) (item-buf));
+				return 0;
+			}
+			em_increment_count(state, fun);
+			break;
+		}
+		default:
+			fprintf(stderr, "Unknown item at offset %zu\n", (size_t) (item-buf));
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int
+em_import_packed_file(EMState* state, GuString fpath)
+{
+	int fd = open(fpath, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Error opening %s\n", fpath);
+		return 0;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return 0;
+	}
+
+	if (st.st_size == 0) {
+		close(fd);
+		return 1;
+	}
+
+	void* buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		return 0;
+
+	int res = em_import_packed_trees(state, buf, st.st_size);
+
+	munmap(buf, st.st_size);
+	return res;
+}
+
 #ifndef DISABLE_LZMA
 static char*
 lzma_fgets(char* inbuf, size_t insize, char* outbuf, size_t outsize, size_t* len,
@@ -581,15 +1053,13 @@ lzma_fgets(char* inbuf, size_t insize, char* outbuf, size_t outsize, size_t* len
 #endif
 
 typedef struct {
-	PgfMorphoCallback base;
-	EMState* state;
+	EMMorphoCallback base;
 	GuBuf* lemmas;
 } LookupCallback;
 
 static void
-lookup_callback(PgfMorphoCallback* callback,
-	            PgfCId lemma, GuString analysis, prob_t prob,
-	            GuExn* err)
+lookup_callback(EMMorphoCallback* callback,
+	            PgfCId lemma, GuExn* err)
 {
 	LookupCallback* self =
 		gu_container(callback, LookupCallback, base);
@@ -607,34 +1077,141 @@ lookup_callback(PgfMorphoCallback* callback,
 	}
 }
 
-int
-em_import_treebank(EMState* state, GuString fpath, GuString lang)
+static void
+lookup_lemmas(EMLexicon* lex, EMLanguage* concr,
+              CONLLFields* fields, GuPool* pool)
 {
-	PgfConcr* concr = pgf_get_language(state->pgf, lang);
-	if (concr == NULL) {
-		fprintf(stderr, "Couldn't find language %s", lang);
-		return 0;
+	LookupCallback callback;
+	callback.base.callback = lookup_callback;
+	callback.lemmas = gu_new_buf(PgfCId, pool);
+
+	lex->lookup_morpho(lex, concr, fields->value[1], &callback.base, NULL);
+	if (gu_buf_length(callback.lemmas) == 0) {
+		// try with lower case
+		char buffer[strlen(fields->value[1])*6+1];
+
+		const uint8_t* src = (uint8_t*) fields->value[1];
+		uint8_t* dst = (uint8_t*) buffer;
+
+		while (*src) {
+			GuUCS ucs = gu_utf8_decode(&src);
+			ucs = gu_ucs_to_lower(ucs);
+			gu_utf8_encode(ucs, &dst);
+		}
+		*(dst++) = 0;
+
+		lex->lookup_morpho(lex, concr, buffer, &callback.base, NULL);
 	}
 
-	FILE* inp;
-#ifndef DISABLE_LZMA
-	uint8_t inbuf[BUFSIZ];
-	lzma_stream stream = LZMA_STREAM_INIT;
-#endif
-	char line[BUFSIZ];
+	fields->lemmas = callback.lemmas;
+}
 
-	bool decompress = false;
-	if (fpath == NULL || *fpath == 0)
-		inp = stdin;
-	else {
-		inp = fopen(fpath, "r");
+// The sentences are read in batches, and the words in a batch are
+// looked up in the lexicon by the pool of threads. The trees are then
+// built in the original order, since that updates the counts and
+// calls the ranking callbacks.
+#define EM_IMPORT_BATCH 1024
 
-#ifndef DISABLE_LZMA
-		if (inp != NULL && strcmp(fpath+(strlen(fpath)-3),".xz") == 0) {
-			lzma_ret ret = lzma_stream_decoder(
-								&stream, UINT64_MAX, LZMA_CONCATENATED);
-			if (ret != LZMA_OK) {
-				fprintf(stderr, "Error initializing LZMA %s\n", fpath);
+typedef struct {
+	GuPool* pool;   // used only by the thread which handles the sentence
+	GuBuf* fields;  // of CONLLFields
+} ImportSentence;
+
+typedef struct {
+	EMTask task;
+	EMLanguage* concr;
+	size_t n_sentences;
+	size_t index;  // the next sentence to look up
+	ImportSentence sentences[EM_IMPORT_BATCH];
+} ImportTask;
+
+static void
+import_lookup(EMTask* task, EMThreadState* tstate)
+{
+	ImportTask* self = gu_container(task, ImportTask, task);
+	EMLexicon* lex = tstate->state->lex;
+
+	for (;;) {
+		size_t i = __sync_fetch_and_add(&self->index, 1);
+		if (i >= self->n_sentences)
+			break;
+
+		ImportSentence* sentence = &self->sentences[i];
+		size_t n_fields = gu_buf_length(sentence->fields);
+		for (size_t j = 0; j < n_fields; j++) {
+			CONLLFields* fields =
+				gu_buf_index(sentence->fields, CONLLFields, j);
+			lookup_lemmas(lex, self->concr, fields, sentence->pool);
+		}
+	}
+}
+
+static void
+import_free_sentences(ImportTask* task)
+{
+	for (size_t i = 0; i < task->n_sentences; i++) {
+		gu_pool_free(task->sentences[i].pool);
+	}
+	task->n_sentences = 0;
+}
+
+static void
+import_sentences(EMState* state, ImportTask* task)
+{
+	task->index = 0;
+	em_run_task(state, &task->task);
+
+	for (size_t k = 0; k < task->n_sentences; k++) {
+		GuSeq* conll = gu_buf_data_seq(task->sentences[k].fields);
+		for (int i = 0; i < gu_seq_length(conll); i++) {
+			CONLLFields* fields = gu_seq_index(conll, CONLLFields, i);
+			if (strcmp(fields->value[6], "0") == 0) {
+				em_start_dep_tree(state);
+				DepTree *dtree = 
+					build_dep_tree(state, conll, i, fields);
+				size_t n_tree_choices = 0;
+				filter_dep_tree(state, dtree, conll, 
+				                NULL, 0, &n_tree_choices);
+				if (state->max_tree_choices < n_tree_choices)
+					state->max_tree_choices = n_tree_choices;
+				em_add_dep_tree(state, dtree);
+				break;
+			}
+		}
+	}
+
+	import_free_sentences(task);
+}
+
+int
+em_import_treebank(EMState* state, GuString fpath, GuString lang)
+{
+	EMLexicon* lex = state->lex;
+	EMLanguage* concr = lex->get_language(lex, lang);
+	if (concr == NULL) {
+		fprintf(stderr, "Couldn't find language %s", lang);
+		return 0;
+	}
+
+	FILE* inp;
+#ifndef DISABLE_LZMA
+	uint8_t inbuf[BUFSIZ];
+	lzma_stream stream = LZMA_STREAM_INIT;
+#endif
+	char line[BUFSIZ];
+
+	bool decompress = false;
+	if (fpath == NULL || *fpath == 0)
+		inp = stdin;
+	else {
+		inp = fopen(fpath, "r");
+
+#ifndef DISABLE_LZMA
+		if (inp != NULL && strcmp(fpath+(strlen(fpath)-3),".xz") == 0) {
+			lzma_ret ret = lzma_stream_decoder(
+								&stream, UINT64_MAX, LZMA_CONCATENATED);
+			if (ret != LZMA_OK) {
+				fprintf(stderr, "Error initializing LZMA %s\n", fpath);
 				return 0;
 			}
 			stream.next_out  = line;
@@ -648,6 +1225,15 @@ em_import_treebank(EMState* state, GuString fpath, GuString lang)
 		return 0;
 	}
 
+	ImportTask* task = malloc(sizeof(ImportTask));
+	if (task == NULL) {
+		fclose(inp);
+		return 0;
+	}
+	task->task.run    = import_lookup;
+	task->concr       = concr;
+	task->n_sentences = 0;
+
 	GuPool* tmp_pool = gu_new_pool();
 	GuBuf* buf = gu_new_buf(CONLLFields, tmp_pool);
 
@@ -666,6 +1252,8 @@ em_import_treebank(EMState* state, GuString fpath, GuString lang)
 
 		if (len < 1 || line[len-1] != '\n') {
 			fprintf(stderr, "Error in reading. Last read: %s\n", line);
+			import_free_sentences(task);
+			free(task);
 			gu_pool_free(tmp_pool);
 			fclose(inp);
 			return 0;
@@ -677,25 +1265,12 @@ em_import_treebank(EMState* state, GuString fpath, GuString lang)
 
 		// empty line signals the end of a sentence
 		if (line[0] == '\n') {
-			GuSeq* conll = gu_buf_data_seq(buf);
-			for (int i = 0; i < gu_seq_length(conll); i++) {
-				CONLLFields* fields = gu_seq_index(conll, CONLLFields, i);
-				if (strcmp(fields->value[6], "0") == 0) {
-					em_start_dep_tree(state);
-					DepTree *dtree = 
-						build_dep_tree(state, concr,
-					                   conll, i, fields);
-					size_t n_tree_choices = 0;
-					filter_dep_tree(state, dtree, conll, 
-					                NULL, 0, &n_tree_choices);
-					if (state->max_tree_choices < n_tree_choices)
-						state->max_tree_choices = n_tree_choices;
-					em_add_dep_tree(state, dtree);
-					break;
-				}
-			}
+			ImportSentence* sentence = &task->sentences[task->n_sentences++];
+			sentence->pool   = tmp_pool;
+			sentence->fields = buf;
+			if (task->n_sentences == EM_IMPORT_BATCH)
+				import_sentences(state, task);
 
-			gu_pool_free(tmp_pool);
 			tmp_pool = gu_new_pool();
 			buf = gu_new_buf(CONLLFields, tmp_pool);
 			continue;
@@ -717,6 +1292,8 @@ em_import_treebank(EMState* state, GuString fpath, GuString lang)
 
 			if (n_fields >= CONLL_NUM_FIELDS) {
 				fprintf(stderr, "Too many fields in: %s\n", line);
+				import_free_sentences(task);
+				free(task);
 				gu_pool_free(tmp_pool);
 				fclose(inp);
 				return 0;
@@ -732,36 +1309,17 @@ em_import_treebank(EMState* state, GuString fpath, GuString lang)
 			start = end;
 		}
 
-		LookupCallback callback;
-		callback.base.callback = lookup_callback;
-		callback.state  = state;
-		callback.lemmas = gu_new_buf(PgfCId, tmp_pool);
-
-		pgf_lookup_morpho(concr, fields->value[1], &callback.base, NULL);
-		if (gu_buf_length(callback.lemmas) == 0) {
-			// try with lower case
-			char buffer[strlen(fields->value[1])*6+1];
-
-			const uint8_t* src = (uint8_t*) fields->value[1];
-			uint8_t* dst = (uint8_t*) buffer;
-
-			while (*src) {
-				GuUCS ucs = gu_utf8_decode(&src);
-				ucs = gu_ucs_to_lower(ucs);
-				gu_utf8_encode(ucs, &dst);
-			}
-			*(dst++) = 0;
-
-			pgf_lookup_morpho(concr, buffer, &callback.base, NULL);
-		}
-
-		fields->lemmas = callback.lemmas;
+		// the lemmas are looked up in import_sentences
+		fields->lemmas = NULL;
 
 		while (n_fields < CONLL_NUM_FIELDS) {
 			fields->value[n_fields++] = "";
 		}
     }
 
+	import_sentences(state, task);
+	free(task);
+
 	gu_pool_free(tmp_pool);
 
 	fclose(inp);
@@ -826,8 +1384,8 @@ em_load_model(EMState* state, GuString fpath)
 		ProbCount** pc = gu_map_insert(stats->mods, fields[1]);
 		if (*pc == NULL) {
 			prob_t back_off =
-				get_pgf_prob(state,fields[0]) +
-				get_pgf_prob(state,fields[1]);
+				get_lexicon_prob(state,fields[0]) +
+				get_lexicon_prob(state,fields[1]);
 
 			prob_t bigram_smoothing1m = 
 				-log1p(-exp(-state->bigram_smoothing));
@@ -838,10 +1396,11 @@ em_load_model(EMState* state, GuString fpath)
 
 			*pc = gu_new(ProbCount, state->pool);
 			(*pc)->prob  = prob;
+			(*pc)->n_fixed = 0;
 			for (size_t i = 0; i < NUM_THREADS; i++) {
 				(*pc)->count[i] = INFINITY;
 			}
-			gu_buf_push(state->pcs, ProbCount*, *pc);
+			add_prob_count(state, *pc);
 		}
 	}
 
@@ -906,35 +1465,91 @@ dtree_match_same_lemma(GuSeq* conll, DepTree *dtree, PgfCId lemma)
 	return 0;
 }
 
+// The E-step kernels are specialized at compile time. The semiring is
+// a constant argument of functions which are always inlined, so every
+// wrapper below gets its own copy without indirect calls. In the same way
+// the loops over the choices are instantiated for up to EM_MAX_UNROLL
+// choices of the head and of the modifier, which covers most nodes,
+// and the compiler can unroll them completely.
+
+#define EM_INLINE static inline __attribute__((always_inline))
+#define EM_MAX_UNROLL 4
+
+// Calls KERNEL(h,c) with h and c as constants when they are small enough
+#define EM_DISPATCH_MOD(h, c, KERNEL)     \
+	switch (c) {                          \
+	case 1:  KERNEL(h, 1); break;         \
+	case 2:  KERNEL(h, 2); break;         \
+	case 3:  KERNEL(h, 3); break;         \
+	case 4:  KERNEL(h, 4); break;         \
+	default: KERNEL(h, c); break;         \
+	}
+
+#define EM_DISPATCH(h, c, KERNEL)                      \
+	switch (h) {                                       \
+	case 1:  EM_DISPATCH_MOD(1, c, KERNEL); break;     \
+	case 2:  EM_DISPATCH_MOD(2, c, KERNEL); break;     \
+	case 3:  EM_DISPATCH_MOD(3, c, KERNEL); break;     \
+	case 4:  EM_DISPATCH_MOD(4, c, KERNEL); break;     \
+	default: KERNEL(h, c); break;                      \
+	}
+
+EM_INLINE prob_t
+semiring_plus(bool max, prob_t x, prob_t y)
+{
+	return max ? log_max(x, y) : log_add(x, y);
+}
+
+static prob_t
+tree_sum_estimation_max(EMThreadState* tstate, DepTree* dtree);
+
 static prob_t
-tree_sum_estimation(EMThreadState* tstate, DepTree* dtree, Oper oper)
+tree_sum_estimation_add(EMThreadState* tstate, DepTree* dtree);
+
+EM_INLINE prob_t
+tree_sum_estimation(EMThreadState* tstate, DepTree* dtree, bool max)
 {
 	size_t n_choices = dtree->n_choices;
 	if (n_choices == 0) {
 		prob_t prob = 0;
 		for (size_t i = 0; i < dtree->n_children; i++) {
-			prob += tree_sum_estimation(tstate, dtree->children[i], oper);
+			prob += max ? tree_sum_estimation_max(tstate, dtree->children[i])
+			            : tree_sum_estimation_add(tstate, dtree->children[i]);
 		}
 		return prob;
 	} else {
 		prob_t  prob         = INFINITY;
 		prob_t *inside_probs = tstate->inside_probs[dtree->index];
 		for (size_t i = 0; i < n_choices; i++) {
-			prob = oper(prob, inside_probs[i]);
+			prob = semiring_plus(max, prob, inside_probs[i]);
 		}
 		return prob;
 	}
 }
 
 static prob_t
-tree_edge_estimation(EMThreadState* tstate, 
-                     size_t head_i, DepTree* mod, Oper oper)
+tree_sum_estimation_max(EMThreadState* tstate, DepTree* dtree)
+{
+	return tree_sum_estimation(tstate, dtree, true);
+}
+
+static prob_t
+tree_sum_estimation_add(EMThreadState* tstate, DepTree* dtree)
+{
+	return tree_sum_estimation(tstate, dtree, false);
+}
+
+// The estimation for the edge from the head_i-th choice of the head
+// to mod. Used by the annotation where it is not time critical.
+static prob_t
+tree_edge_estimation_max(EMThreadState* tstate,
+                         size_t head_i, DepTree* mod)
 {
 	prob_t edge_prob = INFINITY;
 
 	size_t n_choices = mod->n_choices;
 	if (n_choices == 0) {
-		edge_prob = tree_sum_estimation(tstate, mod, oper);
+		edge_prob = tree_sum_estimation_max(tstate, mod);
 		if (edge_prob == INFINITY)
 			return 0;
 	}
@@ -942,192 +1557,749 @@ tree_edge_estimation(EMThreadState* tstate,
 	prob_t *inside_probs = tstate->inside_probs[mod->index];
 	for (size_t i = 0; i < n_choices; i++) {
 		edge_prob =
-		   oper(edge_prob,
-				mod->choices[i].prob_counts[head_i]->prob +
-				inside_probs[i]);
+		   log_max(edge_prob,
+		           mod->choices[i].prob_counts[head_i]->prob +
+		           inside_probs[i]);
 	}
 	return edge_prob;
 }
 
+// Adds the estimation for the edge to mod to the inside probabilities
+// of all choices of the head.
+EM_INLINE void
+edge_estimation_kernel(EMThreadState* tstate,
+                       size_t n_head_choices, prob_t* inside_probs,
+                       DepTree* mod, size_t n_mod_choices,
+                       bool max)
+{
+	prob_t *mod_inside_probs = tstate->inside_probs[mod->index];
+	for (size_t i = 0; i < n_head_choices; i++) {
+		prob_t edge_prob = INFINITY;
+		for (size_t k = 0; k < n_mod_choices; k++) {
+			edge_prob =
+				semiring_plus(max, edge_prob,
+				              mod->choices[k].prob_counts[i]->prob +
+				              mod_inside_probs[k]);
+		}
+		inside_probs[i] += edge_prob;
+	}
+}
+
+EM_INLINE void
+edge_estimation(EMThreadState* tstate,
+                size_t n_head_choices, prob_t* inside_probs,
+                DepTree* mod, bool max)
+{
+	size_t n_mod_choices = mod->n_choices;
+	if (n_mod_choices == 0) {
+		prob_t edge_prob = max ? tree_sum_estimation_max(tstate, mod)
+		                       : tree_sum_estimation_add(tstate, mod);
+		if (edge_prob == INFINITY)
+			edge_prob = 0;
+		for (size_t i = 0; i < n_head_choices; i++) {
+			inside_probs[i] += edge_prob;
+		}
+		return;
+	}
+
+#define EDGE_ESTIMATION(h,c) \
+	edge_estimation_kernel(tstate, h, inside_probs, mod, c, max)
+	EM_DISPATCH(n_head_choices, n_mod_choices, EDGE_ESTIMATION);
+#undef EDGE_ESTIMATION
+}
+
+// The inside probabilities for the Viterbi semiring
 static void
-tree_estimation(EMThreadState* tstate, DepTree* dtree, Oper oper)
+tree_estimation(EMThreadState* tstate, DepTree* dtree)
 {
 	for (size_t i = 0; i < dtree->n_children; i++) {
-		tree_estimation(tstate, dtree->children[i], oper);
+		tree_estimation(tstate, dtree->children[i]);
 	}
 
-	gu_assert(dtree->index <= tstate->state->max_tree_index);
+	gu_assert(dtree->index < tstate->n_inside_probs);
 
 	size_t n_choices = dtree->n_choices;
 	prob_t *inside_probs = &tstate->estimates[tstate->n_estimates];
 	tstate->inside_probs[dtree->index] = inside_probs;
 	tstate->n_estimates += n_choices;
 
-	gu_assert(tstate->n_estimates <= tstate->state->max_tree_choices);
+	gu_assert(tstate->n_estimates < tstate->n_estimates_cap);
+
+	tstate->stats.n_edges   += dtree->n_children;
+	tstate->stats.n_choices += n_choices;
+
+	if (n_choices == 0)
+		return;
 
 	for (size_t i = 0; i < n_choices; i++) {
-		prob_t prob = 0;
-		for (size_t j = 0; j < dtree->n_children; j++) {
-			prob += tree_edge_estimation(tstate, i, dtree->children[j], oper);
-		}
+		inside_probs[i] = 0;
+	}
 
-		inside_probs[i] = prob;
+	for (size_t j = 0; j < dtree->n_children; j++) {
+		edge_estimation(tstate, n_choices, inside_probs,
+		                dtree->children[j], true);
 	}
 }
 
-static void
-tree_counting(EMThreadState* tstate, DepTree* dtree, prob_t* outside_probs)
+// The outside probabilities are kept next to the inside probabilities
+// in a per thread buffer
+EM_INLINE prob_t*
+get_outside_probs(EMThreadState* tstate, DepTree* dtree)
+{
+	return tstate->outside_estimates +
+	       (tstate->inside_probs[dtree->index] - tstate->estimates);
+}
+
+EM_INLINE void
+add_count(EMThreadState* tstate, ProbCount* pc, prob_t prob)
 {
-	EMState *state = tstate->state;
+#ifdef EM_NUMA
+	if (pc->id < tstate->n_counts) {
+		tstate->counts[pc->id] = log_add(tstate->counts[pc->id], prob);
+		return;
+	}
+#endif
+	pc->count[tstate->thread_idx] =
+		log_add(pc->count[tstate->thread_idx], prob);
+}
+
+EM_INLINE void
+edge_counting_kernel(EMThreadState* tstate,
+                     size_t n_head_choices,
+                     prob_t* outside_probs, prob_t* inside_probs,
+                     DepTree* mod, size_t n_mod_choices)
+{
+	prob_t *mod_inside_probs  = tstate->inside_probs[mod->index];
+	prob_t *mod_outside_probs = get_outside_probs(tstate, mod);
+
+	for (size_t k = 0; k < n_mod_choices; k++) {
+		mod_outside_probs[k] = INFINITY;
+	}
+
+	for (size_t j = 0; j < n_head_choices; j++) {
+		if (inside_probs[j] < INFINITY) {
+			prob_t edge_prob = INFINITY;
+			for (size_t k = 0; k < n_mod_choices; k++) {
+				edge_prob =
+					log_add(edge_prob,
+					        mod->choices[k].prob_counts[j]->prob +
+					        mod_inside_probs[k]);
+			}
+
+			prob_t prob = outside_probs[j] + inside_probs[j] - edge_prob;
+
+			for (size_t k = 0; k < n_mod_choices; k++) {
+				ProbCount* pc = mod->choices[k].prob_counts[j];
+
+				prob_t p1 = prob + pc->prob;
+				prob_t p2 = p1   + mod_inside_probs[k];
+				mod_outside_probs[k] = log_add(mod_outside_probs[k],p1);
+				add_count(tstate, pc, p2);
+			}
+		}
+	}
+}
 
+// The outside probabilities of the root must be set
+// with get_outside_probs before the call.
+static void
+tree_counting(EMThreadState* tstate, DepTree* dtree)
+{
 	size_t n_head_choices = dtree->n_choices;
-	prob_t *inside_probs = tstate->inside_probs[dtree->index];
+	prob_t *inside_probs  = tstate->inside_probs[dtree->index];
+	prob_t *outside_probs = get_outside_probs(tstate, dtree);
 	for (size_t j = 0; j < n_head_choices; j++) {
 		SenseChoice* head_choice = &dtree->choices[j];
 
 		prob_t prob = outside_probs[j] + inside_probs[j];
-		head_choice->stats->pc.count[tstate->thread_idx] =
-			log_add(head_choice->stats->pc.count[tstate->thread_idx], prob);
+		add_count(tstate, &head_choice->stats->pc, prob);
 	}
 
 	for (size_t i = 0; i < dtree->n_children; i++) {
-		size_t n_child_choices = dtree->children[i]->n_choices;
-		prob_t child_outside_probs[n_child_choices];
-		prob_t *child_inside_probs =
-			tstate->inside_probs[dtree->children[i]->index];
-
-		if (n_head_choices > 0) {
-			for (size_t k = 0; k < n_child_choices; k++) {
-				child_outside_probs[k] = INFINITY;
-			}
-
-			for (size_t j = 0; j < n_head_choices; j++) {
-				if (inside_probs[j] < INFINITY) {
-					prob_t prob =
-						outside_probs[j] + inside_probs[j] -
-						tree_edge_estimation(tstate, j, dtree->children[i], log_add);
-
-					for (size_t k = 0; k < n_child_choices; k++) {
-						SenseChoice* mod_choice =
-							&dtree->children[i]->choices[k];
-
-						ProbCount* pc = mod_choice->prob_counts[j];
-
-						prob_t p1 = prob + pc->prob;
-						prob_t p2 = p1   + child_inside_probs[k];
-						child_outside_probs[k] = log_add(child_outside_probs[k],p1);
-						pc->count[tstate->thread_idx] =
-							log_add(pc->count[tstate->thread_idx],p2);
-					}
-				}
-			}
-		} else {
-			prob_t sum = tree_sum_estimation(tstate, dtree->children[i], log_add);
-			for (size_t k = 0; k < n_child_choices; k++) {
-				child_outside_probs[k] = -sum;
+		DepTree* mod = dtree->children[i];
+		size_t n_mod_choices = mod->n_choices;
+
+		if (n_head_choices == 0) {
+			prob_t sum = tree_sum_estimation_add(tstate, mod);
+			prob_t *mod_outside_probs = get_outside_probs(tstate, mod);
+			for (size_t k = 0; k < n_mod_choices; k++) {
+				mod_outside_probs[k] = tstate->weight - sum;
 			}
+		} else if (n_mod_choices > 0) {
+#define EDGE_COUNTING(h,c) \
+			edge_counting_kernel(tstate, h, outside_probs, inside_probs, mod, c)
+			EM_DISPATCH(n_head_choices, n_mod_choices, EDGE_COUNTING);
+#undef EDGE_COUNTING
 		}
 
-		tree_counting(tstate, dtree->children[i], child_outside_probs);
+		tree_counting(tstate, mod);
 	}
 }
 
-static void *
-em_learner(void *arguments)
+// Adds the counts for the subtrees removed by compact_dep_tree and
+// returns the log probability of the removed edges
+static prob_t
+add_fixed_counts(EMState* state)
+{
+	size_t n_unigrams = gu_buf_length(state->fixed_unigrams);
+	for (size_t i = 0; i < n_unigrams; i++) {
+		ProbCount* pc = gu_buf_get(state->fixed_unigrams, ProbCount*, i);
+		pc->count[0] = log_add(pc->count[0], -log(pc->n_fixed));
+	}
+
+	prob_t prob = 0;
+	size_t n_bigrams = gu_buf_length(state->fixed_bigrams);
+	for (size_t i = 0; i < n_bigrams; i++) {
+		ProbCount* pc = gu_buf_get(state->fixed_bigrams, ProbCount*, i);
+		pc->count[0] = log_add(pc->count[0], -log(pc->n_fixed));
+		prob += pc->n_fixed * pc->prob;
+	}
+	return prob;
+}
+
+#ifdef EM_NUMA
+static void
+reserve_counts(EMThreadState* tstate, size_t n_pcs)
+{
+	if (tstate->n_counts >= n_pcs)
+		return;
+
+	// The old array is left in the pool, so grow it
+	// geometrically in case of repeated imports.
+	size_t n_counts = tstate->n_counts*2;
+	if (n_counts < n_pcs)
+		n_counts = n_pcs;
+
+	tstate->counts   = gu_new_n(prob_t, n_counts, tstate->pool);
+	tstate->n_counts = n_counts;
+	for (size_t i = 0; i < n_counts; i++) {
+		tstate->counts[i] = INFINITY;
+	}
+}
+
+static void
+flush_counts(EMThreadState* tstate)
 {
-	EMThreadState* tstate = (EMThreadState *) arguments;
 	EMState* state = tstate->state;
+	size_t n_pcs = gu_buf_length(state->pcs);
+	for (size_t i = 0; i < n_pcs; i++) {
+		if (tstate->counts[i] < INFINITY) {
+			ProbCount* pc = gu_buf_get(state->pcs, ProbCount*, i);
+			pc->count[tstate->thread_idx] =
+				log_add(pc->count[tstate->thread_idx], tstate->counts[i]);
+			tstate->counts[i] = INFINITY;
+		}
+	}
+}
+#endif
 
-	for (;;) {
-		pthread_barrier_wait(&state->barrier1);
+typedef struct {
+	EMTask task;
+	bool normalize;
+	size_t index;  // the next ProbCount to normalize
+} EMLearnerTask;
 
-		if (state->finished)
-			break;
+static void
+em_learner(EMTask* task, EMThreadState* tstate)
+{
+	EMLearnerTask* self = gu_container(task, EMLearnerTask, task);
+	EMState* state = tstate->state;
 
-		if (tstate->inside_probs == NULL)
-			tstate->inside_probs =
-				gu_new_n(prob_t*, state->max_tree_index+1, state->pool);
-		if (tstate->estimates == NULL)
-			tstate->estimates =
-				gu_new_n(prob_t,state->max_tree_choices+1, state->pool);
-
-		// Normalize counts to probabilities
-		size_t n_pcs = gu_buf_length(state->pcs);
-		while (state->index1 < n_pcs) {
-			size_t batch = 256;
-			size_t start = __sync_fetch_and_add(&state->index1, batch);
-
-			size_t end   = start + batch;
-			if (end > n_pcs)
-				end = n_pcs;
-
-			for (size_t i = start; i < end; i++) {
-				ProbCount* pc =
-					gu_buf_get(state->pcs, ProbCount*, i);
-				pc->prob  = INFINITY;
-				for (size_t i = 0; i < NUM_THREADS; i++) {
-					pc->prob     = log_add(pc->prob, pc->count[i]);
-					pc->count[i] = INFINITY;
-				}
+	memset(&tstate->stats, 0, sizeof(EMThreadStats));
+	uint64_t t0 = em_clock();
+
+	// Normalize counts to probabilities
+	size_t n_pcs = gu_buf_length(state->pcs);
+	while (self->normalize && self->index < n_pcs) {
+		size_t batch = 256;
+		size_t start = __sync_fetch_and_add(&self->index, batch);
+
+		size_t end   = start + batch;
+		if (end > n_pcs)
+			end = n_pcs;
+
+		for (size_t i = start; i < end; i++) {
+			ProbCount* pc =
+				gu_buf_get(state->pcs, ProbCount*, i);
+			pc->prob  = INFINITY;
+			for (size_t i = 0; i < NUM_THREADS; i++) {
+				pc->prob     = log_add(pc->prob, pc->count[i]);
+				pc->count[i] = INFINITY;
 			}
 		}
+	}
 
-		em_data_stream_restart(state->stream, tstate->thread_idx, state->err);
-		if (gu_exn_is_raised(state->err)) {
-			printf("em_learner: i/o error\n");
-			exit(1);
-		}
+	em_data_stream_restart(state->stream, tstate->thread_idx, state->err);
+	if (gu_exn_is_raised(state->err)) {
+		printf("em_learner: i/o error\n");
+		exit(1);
+	}
 
-		pthread_barrier_wait(&state->barrier2);
+	uint64_t t1 = em_clock();
+	tstate->stats.time[EM_PHASE_NORMALIZE] += t1-t0;
 
-		// Estimate the new counts
-		tstate->prob = 0;
-		for(;;) {
-			DepTree* dtree =
-				em_data_stream_fetch_element(state->stream, tstate->thread_idx);
-			if (dtree == NULL)
-				break;
+	pthread_barrier_wait(&state->barrier2);
 
-			tstate->n_estimates = 0;
-			tree_estimation(tstate, dtree, log_max);
+	uint64_t t2 = em_clock();
+	tstate->stats.time[EM_PHASE_BARRIER] += t2-t1;
 
-			prob_t sum = tree_sum_estimation(tstate, dtree, log_add);
-			
-			tstate->prob += sum;
+	// Estimate the new counts
+#ifdef EM_NUMA
+	reserve_counts(tstate, n_pcs);
+#endif
+	tstate->prob = 0;
+	if (tstate->thread_idx == 0)
+		tstate->prob = add_fixed_counts(state);
+	for(;;) {
+		StreamTree* elem =
+			em_data_stream_fetch_element(state->stream, tstate->thread_idx);
 
-			prob_t outside_probs[dtree->n_choices];
-			for (size_t j = 0; j < dtree->n_choices; j++) {
-				outside_probs[j] = -sum;
-			}
+		uint64_t t3 = em_clock();
+		tstate->stats.time[EM_PHASE_FETCH] += t3-t2;
 
-			tree_counting(tstate, dtree, outside_probs);
+		if (elem == NULL)
+			break;
+
+		DepTree* dtree = elem->dtree;
+		size_t n_copies = (elem->weight == NULL) ? 1 : *elem->weight;
+
+		tstate->stats.n_trees++;
+
+		tstate->n_estimates = 0;
+		tree_estimation(tstate, dtree);
+
+		prob_t sum = tree_sum_estimation_add(tstate, dtree);
+		
+		tstate->prob += n_copies*sum;
+
+		// the counts are scaled by the number of copies
+		tstate->weight = -log(n_copies);
+
+		prob_t *outside_probs = get_outside_probs(tstate, dtree);
+		for (size_t j = 0; j < dtree->n_choices; j++) {
+			outside_probs[j] = tstate->weight - sum;
 		}
 
-		pthread_barrier_wait(&state->barrier3);
+		uint64_t t4 = em_clock();
+		tstate->stats.time[EM_PHASE_INSIDE] += t4-t3;
+
+		tree_counting(tstate, dtree);
+
+		t2 = em_clock();
+		tstate->stats.time[EM_PHASE_OUTSIDE] += t2-t4;
 	}
-	return NULL;
+
+#ifdef EM_NUMA
+	uint64_t t6 = em_clock();
+	flush_counts(tstate);
+	tstate->stats.time[EM_PHASE_OUTSIDE] += em_clock()-t6;
+#endif
+
+	// Wait here rather than in the pool, so that the time
+	// spent waiting for the other threads is counted.
+	uint64_t t5 = em_clock();
+	pthread_barrier_wait(&state->barrier2);
+	tstate->stats.time[EM_PHASE_BARRIER] += em_clock()-t5;
 }
 
-prob_t
-em_step(EMState *state)
+static prob_t
+em_run_learners(EMState *state, bool normalize)
 {
-	state->index1 = 0;
-	state->index2 = 0;
+	EMLearnerTask task;
+	task.task.run  = em_learner;
+	task.normalize = normalize;
+	task.index     = 0;
 
-	pthread_barrier_wait(&state->barrier1);
+	em_data_stream_reset_stats(state->stream);
 
-	//wait for all threads to complete
-	pthread_barrier_wait(&state->barrier3);
+	uint64_t start = em_clock();
+
+	em_run_task(state, &task.task);
 
-	prob_t corpus_prob = state->bigram_total*log(state->bigram_total);
+	state->step_time = em_clock()-start;
+
+	prob_t prob = 0;
 	for (int i = 0; i < NUM_THREADS; i++) {
-		corpus_prob += state->threads[i].prob;
+		prob += state->threads[i].prob;
 	}
+	return prob;
+}
+
+prob_t
+em_step(EMState *state)
+{
+	prob_t corpus_prob =
+		state->bigram_total*log(state->bigram_total) +
+		em_run_learners(state, true);
+
+	state->corpus_prob = corpus_prob;
 
 	// return the new corpus probability
 	return corpus_prob;
 }
 
+prob_t
+em_estimate(EMState *state)
+{
+	state->corpus_prob = em_run_learners(state, false);
+	return state->corpus_prob;
+}
+
+// The files for distributed training start with a header followed
+// by n_records records in native byte order. A record with mod equal
+// to EM_NO_MOD is a unigram count.
+
+#define EM_COUNTS_MAGIC 0x31434d45  // "EMC1"
+#define EM_PROBS_MAGIC  0x31504d45  // "EMP1"
+#define EM_NO_MOD       UINT32_MAX
+
+typedef struct {
+	uint32_t magic;
+	uint32_t finished;
+	uint64_t n_funs;
+	uint64_t bigram_total;
+	uint64_t n_records;
+	double corpus_prob;
+} EMCountsHeader;
+
+typedef struct {
+	uint32_t head;
+	uint32_t mod;
+	prob_t value;
+} EMCountsRecord;
+
+static prob_t
+sum_counts(ProbCount* pc)
+{
+	prob_t count = INFINITY;
+	for (size_t i = 0; i < NUM_THREADS; i++) {
+		count = log_add(count, pc->count[i]);
+	}
+	return count;
+}
+
+typedef struct {
+	GuMapItor clo;
+	EMState* state;
+	FunStats* head_stats;
+	bool counts;
+	FILE* out;
+	EMCountsHeader* header;
+	bool ok;
+} WriteCountsItor;
+
+static void
+write_record(WriteCountsItor* self, uint32_t head, uint32_t mod, prob_t value)
+{
+	if (value == INFINITY)
+		return;
+
+	EMCountsRecord record;
+	record.head  = head;
+	record.mod   = mod;
+	record.value = value;
+	if (fwrite(&record, sizeof(record), 1, self->out) != 1)
+		self->ok = false;
+	self->header->n_records++;
+}
+
+static void
+write_mod_record(GuMapItor* clo, const void* key, void* value, GuExn* err)
+{
+	WriteCountsItor* self = gu_container(clo, WriteCountsItor, clo);
+	FunStats* mod_stats =
+		gu_map_get(self->state->stats, (PgfCId) key, FunStats*);
+	ProbCount* pc = *((ProbCount**) value);
+
+	write_record(self, self->head_stats->id, mod_stats->id,
+	             self->counts ? sum_counts(pc) : pc->prob);
+}
+
+static int
+write_records(EMState *state, GuString fpath, EMCountsHeader* header,
+              bool counts)
+{
+	char tmp_fpath[strlen(fpath)+5];
+	sprintf(tmp_fpath, "%s.tmp", fpath);
+
+	WriteCountsItor itor;
+	itor.clo.fn = write_mod_record;
+	itor.state  = state;
+	itor.counts = counts;
+	itor.header = header;
+	itor.ok     = true;
+	itor.out    = fopen(tmp_fpath, "w");
+	if (itor.out == NULL)
+		return 0;
+
+	header->n_funs    = gu_buf_length(state->funs);
+	header->n_records = 0;
+
+	// the header is written again when the number of records is known
+	if (fwrite(header, sizeof(*header), 1, itor.out) != 1)
+		itor.ok = false;
+
+	for (size_t id = 0; id < header->n_funs; id++) {
+		FunStats* stats = gu_buf_get(state->funs, FunStats*, id);
+
+		// only the lexical functions are estimated
+		size_t arity;
+		state->lex->function_cat(state->lex, stats->fun, &arity);
+		if (arity == 0) {
+			write_record(&itor, id, EM_NO_MOD,
+			             counts ? sum_counts(&stats->pc) : stats->pc.prob);
+		}
+
+		itor.head_stats = stats;
+		gu_map_iter(stats->mods, &itor.clo, NULL);
+	}
+
+	if (fseek(itor.out, 0, SEEK_SET) != 0 ||
+	    fwrite(header, sizeof(*header), 1, itor.out) != 1)
+		itor.ok = false;
+	if (fclose(itor.out) != 0)
+		itor.ok = false;
+
+	if (!itor.ok || rename(tmp_fpath, fpath) != 0) {
+		remove(tmp_fpath);
+		return 0;
+	}
+
+	return 1;
+}
+
+typedef void (*ReadRecordFn)(EMState* state, FunStats* head, FunStats* mod,
+                             prob_t value);
+
+static int
+read_records(EMState *state, GuString fpath, uint32_t magic,
+             EMCountsHeader* header, ReadRecordFn fn)
+{
+	FILE* inp = fopen(fpath, "r");
+	if (inp == NULL) {
+		fprintf(stderr, "Error opening %s\n", fpath);
+		return 0;
+	}
+
+	size_t n_funs = gu_buf_length(state->funs);
+
+	if (fread(header, sizeof(*header), 1, inp) != 1 ||
+	    header->magic != magic) {
+		fprintf(stderr, "%s is not a counts file\n", fpath);
+		fclose(inp);
+		return 0;
+	}
+	if (header->n_funs != n_funs) {
+		fprintf(stderr, "%s was created with a different grammar\n", fpath);
+		fclose(inp);
+		return 0;
+	}
+
+	EMCountsRecord records[1024];
+	size_t n_records = 0;
+	while (n_records < header->n_records) {
+		size_t n = header->n_records - n_records;
+		if (n > 1024)
+			n = 1024;
+
+		if (fread(records, sizeof(EMCountsRecord), n, inp) != n) {
+			fprintf(stderr, "%s is truncated\n", fpath);
+			fclose(inp);
+			return 0;
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			EMCountsRecord* record = &records[i];
+			if (record->head >= n_funs ||
+			    (record->mod >= n_funs && record->mod != EM_NO_MOD)) {
+				fprintf(stderr, "%s contains an invalid record\n", fpath);
+				fclose(inp);
+				return 0;
+			}
+
+			FunStats* head = gu_buf_get(state->funs, FunStats*, record->head);
+			FunStats* mod  = (record->mod == EM_NO_MOD) ? NULL :
+			                 gu_buf_get(state->funs, FunStats*, record->mod);
+			fn(state, head, mod, record->value);
+		}
+
+		n_records += n;
+	}
+
+	fclose(inp);
+	return 1;
+}
+
+int
+em_write_counts(EMState *state, GuString fpath)
+{
+	EMCountsHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic        = EM_COUNTS_MAGIC;
+	header.bigram_total = state->bigram_total;
+
+	// the log probability from the last em_estimate
+	for (int i = 0; i < NUM_THREADS; i++) {
+		header.corpus_prob += state->threads[i].prob;
+	}
+
+	return write_records(state, fpath, &header, true);
+}
+
+static void
+read_prob(EMState* state, FunStats* head, FunStats* mod, prob_t value)
+{
+	if (mod == NULL) {
+		head->pc.prob = value;
+	} else {
+		// the other workers may have seen bigrams which are unknown here
+		ProbCount* pc = gu_map_get(head->mods, mod->fun, ProbCount*);
+		if (pc != NULL)
+			pc->prob = value;
+	}
+}
+
+int
+em_read_probs(EMState *state, GuString fpath, int* finished)
+{
+	// this replaces the normalization in em_step
+	size_t n_pcs = gu_buf_length(state->pcs);
+	for (size_t i = 0; i < n_pcs; i++) {
+		ProbCount* pc = gu_buf_get(state->pcs, ProbCount*, i);
+		pc->prob = INFINITY;
+		for (size_t j = 0; j < NUM_THREADS; j++) {
+			pc->count[j] = INFINITY;
+		}
+	}
+
+	EMCountsHeader header;
+	if (!read_records(state, fpath, EM_PROBS_MAGIC, &header, read_prob))
+		return 0;
+
+	*finished = header.finished;
+	return 1;
+}
+
+static void
+merge_count(EMState* state, FunStats* head, FunStats* mod, prob_t value)
+{
+	ProbCount* pc;
+	if (mod == NULL) {
+		pc = &head->pc;
+	} else {
+		ProbCount** ppc = gu_map_insert(head->mods, mod->fun);
+		if (*ppc == NULL) {
+			*ppc = gu_new(ProbCount, state->pool);
+			(*ppc)->prob = INFINITY;
+			(*ppc)->n_fixed = 0;
+			for (size_t i = 0; i < NUM_THREADS; i++) {
+				(*ppc)->count[i] = INFINITY;
+			}
+			add_prob_count(state, *ppc);
+		}
+		pc = *ppc;
+	}
+
+	pc->prob = log_add(pc->prob, value);
+}
+
+int
+em_merge_counts(EMState *state, GuString* fpaths, size_t n_fpaths,
+                prob_t* corpus_prob)
+{
+	size_t n_pcs = gu_buf_length(state->pcs);
+	for (size_t i = 0; i < n_pcs; i++) {
+		ProbCount* pc = gu_buf_get(state->pcs, ProbCount*, i);
+		pc->prob = INFINITY;
+	}
+
+	prob_t prob = 0;
+	state->bigram_total = 0;
+	for (size_t i = 0; i < n_fpaths; i++) {
+		EMCountsHeader header;
+		if (!read_records(state, fpaths[i], EM_COUNTS_MAGIC, &header, merge_count))
+			return 0;
+
+		state->bigram_total += header.bigram_total;
+		prob += header.corpus_prob;
+	}
+
+	if (state->bigram_total > 0)
+		prob += state->bigram_total*log(state->bigram_total);
+
+	state->corpus_prob = prob;
+	*corpus_prob = prob;
+	return 1;
+}
+
+int
+em_write_probs(EMState *state, GuString fpath, int finished)
+{
+	EMCountsHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic        = EM_PROBS_MAGIC;
+	header.finished     = finished;
+	header.bigram_total = state->bigram_total;
+	header.corpus_prob  = state->corpus_prob;
+
+	return write_records(state, fpath, &header, false);
+}
+
+void
+em_get_thread_stats(EMState *state, size_t thread_idx, EMThreadStats* stats)
+{
+	gu_assert(thread_idx < NUM_THREADS);
+	*stats = state->threads[thread_idx].stats;
+}
+
+int
+em_dump_stats(EMState *state, GuString fpath, int iteration)
+{
+	// The statistics for all iterations go into one file,
+	// with one JSON object per line.
+	FILE* out = fopen(fpath, (iteration == 0) ? "w" : "a");
+	if (out == NULL)
+		return 0;
+
+	static const char* phase_names[EM_N_PHASES] =
+		{"normalize", "fetch", "inside", "outside", "barrier"};
+
+	EMDataStreamStats stream_stats;
+	em_data_stream_get_stats(state->stream, &stream_stats);
+
+	// JSON has no infinity or NaN, so a corpus with zero
+	// probability is written as null
+	fprintf(out, "{\"iteration\": %d, \"corpus_prob\": ", iteration);
+	if (isfinite(state->corpus_prob))
+		fprintf(out, "%.17g", (double) state->corpus_prob);
+	else
+		fputs("null", out);
+	fprintf(out, ", \"time_ns\": %" PRIu64 ", "
+	             "\"stream\": {\"remaps\": %zu, \"bytes_mapped\": %zu, "
+	             "\"bytes_released\": %zu, \"bytes_overflow\": %zu}, "
+	             "\"threads\": [",
+	             state->step_time,
+	             stream_stats.n_remaps, stream_stats.bytes_mapped,
+	             stream_stats.bytes_released, stream_stats.bytes_overflow);
+	for (size_t i = 0; i < NUM_THREADS; i++) {
+		EMThreadStats* stats = &state->threads[i].stats;
+
+		if (i > 0)
+			fputs(", ", out);
+		fputc('{', out);
+		for (size_t j = 0; j < EM_N_PHASES; j++) {
+			fprintf(out, "\"%s_ns\": %" PRIu64 ", ",
+			        phase_names[j], stats->time[j]);
+		}
+		fprintf(out, "\"trees\": %zu, \"edges\": %zu, \"choices\": %zu}",
+		             stats->n_trees, stats->n_edges, stats->n_choices);
+	}
+	fputs("]}\n", out);
+
+	fclose(out);
+	return 1;
+}
+
 typedef struct {
 	GuMapItor clo1;
 	GuMapItor clo2;
@@ -1144,10 +2316,12 @@ collect_cat_probs(GuMapItor* itor, const void* key, void* value, GuExn* err)
 	DumpIter* self = gu_container(itor, DumpIter, clo1);
 	FunStats* head_stats = *((FunStats**) value);
 	
-	PgfType *ty =
-		pgf_function_type(self->state->pgf, head_stats->fun);
+	EMLexicon* lex = self->state->lex;
+
+	size_t arity;
+	PgfCId cat = lex->function_cat(lex, head_stats->fun, &arity);
 	prob_t *pcount =
-		gu_map_insert(self->cat_probs, ty->cid);
+		gu_map_insert(self->cat_probs, cat);
 	prob_t prob = log_add(head_stats->pc.prob,self->state->unigram_smoothing);
 	*pcount = log_add(*pcount, prob);
 	self->cat_total = log_add(self->cat_total, prob);
@@ -1169,20 +2343,19 @@ dump_mods(GuMapItor* itor, const void* key, void* value, GuExn* err)
 }
 
 static void
-dump_heads(GuMapItor* itor, const void* key, void* value, GuExn* err)
+dump_head(DumpIter* self, FunStats* head_stats)
 {
-	DumpIter* self = gu_container(itor, DumpIter, clo1);
-	FunStats* head_stats = *((FunStats**) value);
-
 	self->head_stats = head_stats;
 
-	PgfType *ty =
-		pgf_function_type(self->state->pgf, head_stats->fun);
+	EMLexicon* lex = self->state->lex;
 
-	double val = exp(gu_map_get(self->cat_probs, ty->cid, prob_t)-log_add(head_stats->pc.prob,self->state->unigram_smoothing));
+	size_t arity;
+	PgfCId cat = lex->function_cat(lex, head_stats->fun, &arity);
+
+	double val = exp(gu_map_get(self->cat_probs, cat, prob_t)-log_add(head_stats->pc.prob,self->state->unigram_smoothing));
 	fprintf(self->funigram, "%s\t%e\n", head_stats->fun, val);
 
-	gu_map_iter(self->head_stats->mods, &self->clo2, err);
+	gu_map_iter(self->head_stats->mods, &self->clo2, NULL);
 }
 
 static void
@@ -1195,6 +2368,49 @@ dump_cats(GuMapItor* itor, const void* key, void* value, GuExn* err)
 	fprintf(self->funigram, "%s\t%e\n", cat, exp(self->cat_total-prob));
 }
 
+// The functions are split in contiguous ranges, one per thread,
+// and every thread writes its range in temporary files. The files
+// are then concatenated in the order of the ranges.
+typedef struct {
+	EMTask task;
+	GuMap* cat_probs;
+	FILE* funigram[NUM_THREADS];
+	FILE* fbigram[NUM_THREADS];
+} DumpTask;
+
+static void
+dump_funs(EMTask* task, EMThreadState* tstate)
+{
+	DumpTask* self = gu_container(task, DumpTask, task);
+	EMState* state = tstate->state;
+
+	DumpIter itor;
+	itor.state     = state;
+	itor.cat_probs = self->cat_probs;
+	itor.funigram  = self->funigram[tstate->thread_idx];
+	itor.fbigram   = self->fbigram[tstate->thread_idx];
+	itor.clo2.fn   = dump_mods;
+
+	size_t n_funs = gu_buf_length(state->funs);
+	size_t start  = (n_funs * tstate->thread_idx) / NUM_THREADS;
+	size_t end    = (n_funs * (tstate->thread_idx+1)) / NUM_THREADS;
+	for (size_t i = start; i < end; i++) {
+		dump_head(&itor, gu_buf_get(state->funs, FunStats*, i));
+	}
+}
+
+static void
+append_file(FILE* out, FILE* inp)
+{
+	char buf[BUFSIZ];
+	size_t len;
+
+	rewind(inp);
+	while ((len = fread(buf, 1, sizeof(buf), inp)) > 0) {
+		fwrite(buf, 1, len, out);
+	}
+}
+
 void
 em_dump(EMState *state, char* unigram_path, char* bigram_path)
 {
@@ -1211,12 +2427,36 @@ em_dump(EMState *state, char* unigram_path, char* bigram_path)
 	itor.clo1.fn = collect_cat_probs;
 	gu_map_iter(state->stats, &itor.clo1, NULL);
 
+	DumpTask task;
+	task.task.run  = dump_funs;
+	task.cat_probs = itor.cat_probs;
+	for (size_t i = 0; i < NUM_THREADS; i++) {
+		task.funigram[i] = tmpfile();
+		task.fbigram[i]  = tmpfile();
+		if (task.funigram[i] == NULL || task.fbigram[i] == NULL) {
+			fprintf(stderr, "em_dump: cannot create temporary files\n");
+			for (size_t j = 0; j <= i; j++) {
+				if (task.funigram[j] != NULL)
+					fclose(task.funigram[j]);
+				if (task.fbigram[j] != NULL)
+					fclose(task.fbigram[j]);
+			}
+			gu_pool_free(tmp_pool);
+			return;
+		}
+	}
+
+	em_run_task(state, &task.task);
+
 	itor.funigram = fopen(unigram_path, "w+");	
 	itor.fbigram = fopen(bigram_path, "w+");
 
-	itor.clo1.fn = dump_heads;
-	itor.clo2.fn = dump_mods;
-	gu_map_iter(state->stats, &itor.clo1, NULL);
+	for (size_t i = 0; i < NUM_THREADS; i++) {
+		append_file(itor.funigram, task.funigram[i]);
+		append_file(itor.fbigram,  task.fbigram[i]);
+		fclose(task.funigram[i]);
+		fclose(task.fbigram[i]);
+	}
 
 	itor.clo1.fn = dump_cats;
 	gu_map_iter(itor.cat_probs, &itor.clo1, NULL);
@@ -1313,7 +2553,7 @@ print_abstract_tree(EMThreadState* tstate,
 
 				prob_t prob =
 					outside_probs[j] + inside_probs[j] -
-					tree_edge_estimation(tstate, j, dtree->children[i], log_max);
+					tree_edge_estimation_max(tstate, j, dtree->children[i]);
 
 				for (size_t k = 0; k < n_child_choices; k++) {
 					SenseChoice* mod_choice = &dtree->children[i]->choices[k];
@@ -1325,7 +2565,7 @@ print_abstract_tree(EMThreadState* tstate,
 				}
 			}
 		} else {
-			prob_t sum = tree_sum_estimation(tstate, dtree->children[i], log_max);
+			prob_t sum = tree_sum_estimation_max(tstate, dtree->children[i]);
 			for (size_t k = 0; k < n_child_choices; k++) {
 				child_outside_probs[k] = -sum;
 			}
@@ -1340,10 +2580,75 @@ print_abstract_tree(EMThreadState* tstate,
 		fputc(')', out);
 }
 
+// Every thread prints its trees in its own temporary file. Each line
+// is preceded by the index of the tree in the stream, which is used
+// for merging the files in the original order.
+typedef struct {
+	EMTask task;
+	FILE* tmp[NUM_THREADS];
+} ExportTask;
+
+static void
+export_trees(EMTask* task, EMThreadState* tstate)
+{
+	ExportTask* self = gu_container(task, ExportTask, task);
+	EMState* state = tstate->state;
+	FILE* out = self->tmp[tstate->thread_idx];
+
+	em_data_stream_restart(state->stream, tstate->thread_idx, state->err);
+	if (gu_exn_is_raised(state->err)) {
+		printf("em_export_abstract_treebank: i/o error\n");
+		exit(1);
+	}
+
+	pthread_barrier_wait(&state->barrier2);
+
+	for (;;) {
+		size_t index;
+		StreamTree* elem =
+			em_data_stream_fetch_indexed_element(state->stream,
+			                                     tstate->thread_idx,
+			                                     &index);
+		if (elem == NULL)
+			break;
+
+		DepTree* dtree = elem->dtree;
+
+		tstate->n_estimates = 0;
+		tree_estimation(tstate, dtree);
+
+		prob_t max = tree_sum_estimation_max(tstate, dtree);
+		prob_t outside_probs[dtree->n_choices];
+		for (size_t j = 0; j < dtree->n_choices; j++) {
+			outside_probs[j] = -max;
+		}
+
+		fwrite(&index, sizeof(index), 1, out);
+		print_abstract_tree(tstate, out, dtree, outside_probs);
+		fputc('\n', out);
+	}
+}
+
+static bool
+read_tree_index(FILE* inp, size_t* index)
+{
+	return (fread(index, sizeof(*index), 1, inp) == 1);
+}
+
 int
 em_export_abstract_treebank(EMState* state, GuString fpath)
 {
-	EMThreadState* tstate = &state->threads[0];
+	ExportTask task;
+	task.task.run = export_trees;
+	for (size_t i = 0; i < NUM_THREADS; i++) {
+		task.tmp[i] = tmpfile();
+		if (task.tmp[i] == NULL) {
+			while (i > 0) {
+				fclose(task.tmp[--i]);
+			}
+			return 0;
+		}
+	}
 
 	FILE *out;
 	if (fpath == NULL || *fpath == 0)
@@ -1351,37 +2656,53 @@ em_export_abstract_treebank(EMState* state, GuString fpath)
 	else {
 		out = fopen(fpath, "w+");
 		if (out == NULL) {
+			for (size_t i = 0; i < NUM_THREADS; i++) {
+				fclose(task.tmp[i]);
+			}
 			return 0;
 		}
 	}
-	
-	em_data_stream_restart(state->stream, tstate->thread_idx, state->err);
-	if (gu_exn_is_raised(state->err)) {
-		printf("em_export_abstract_treebank: i/o error\n");
-		exit(1);
+
+	em_run_task(state, &task.task);
+
+	size_t next[NUM_THREADS];
+	bool more[NUM_THREADS];
+	for (size_t i = 0; i < NUM_THREADS; i++) {
+		rewind(task.tmp[i]);
+		more[i] = read_tree_index(task.tmp[i], &next[i]);
 	}
 
+	int res = 1;
+	char* line = NULL;
+	size_t line_size = 0;
 	for (;;) {
-		DepTree* dtree = 
-			em_data_stream_fetch_element(state->stream, tstate->thread_idx);
-
-		tstate->n_estimates = 0;
-		tree_estimation(tstate, dtree, log_max);
+		int first = -1;
+		for (size_t i = 0; i < NUM_THREADS; i++) {
+			if (more[i] && (first < 0 || next[i] < next[first]))
+				first = i;
+		}
+		if (first < 0)
+			break;
 
-		prob_t max = tree_sum_estimation(tstate, dtree, log_max);
-		prob_t outside_probs[dtree->n_choices];
-		for (size_t j = 0; j < dtree->n_choices; j++) {
-			outside_probs[j] = -max;
+		ssize_t len = getline(&line, &line_size, task.tmp[first]);
+		if (len < 0) {
+			res = 0;
+			break;
 		}
+		fwrite(line, 1, len, out);
 
-		print_abstract_tree(tstate, out, dtree, outside_probs);
-		fprintf(out, "\n");
+		more[first] = read_tree_index(task.tmp[first], &next[first]);
+	}
+	free(line);
+
+	for (size_t i = 0; i < NUM_THREADS; i++) {
+		fclose(task.tmp[i]);
 	}
 
 	if (out != stdout)
 		fclose(out);
 
-	return 1;
+	return res;
 }
 
 static void
@@ -1414,7 +2735,7 @@ em_annotate_dep_tree_(EMThreadState* tstate,
 			for (size_t j = 0; j < n_head_choices; j++) {
 				prob_t prob =
 					outside_probs[j] + inside_probs[j] -
-					tree_edge_estimation(tstate, j, dtree->children[i], log_max);
+					tree_edge_estimation_max(tstate, j, dtree->children[i]);
 
 				for (size_t k = 0; k < n_child_choices; k++) {
 					SenseChoice* mod_choice = &dtree->children[i]->choices[k];
@@ -1425,7 +2746,7 @@ em_annotate_dep_tree_(EMThreadState* tstate,
 				}
 			}
 		} else {
-			prob_t sum = tree_sum_estimation(tstate, dtree->children[i], log_max);
+			prob_t sum = tree_sum_estimation_max(tstate, dtree->children[i]);
 			for (size_t k = 0; k < n_child_choices; k++) {
 				child_outside_probs[k] = -sum;
 			}
@@ -1435,14 +2756,102 @@ em_annotate_dep_tree_(EMThreadState* tstate,
 	}
 }
 
+struct EMAnnotator {
+	GuPool* pool;  // for the scratch buffers
+	EMThreadState tstate;
+};
+
+EMAnnotator*
+em_new_annotator(EMState* state)
+{
+	GuPool* pool = gu_new_pool();
+	EMAnnotator* ann = gu_new(EMAnnotator, pool);
+	ann->pool = pool;
+	em_init_thread_state(&ann->tstate, state, 0);
+	return ann;
+}
+
+void
+em_free_annotator(EMAnnotator* ann)
+{
+	gu_pool_free(ann->pool);
+}
+
+DepTree*
+em_annotator_new_dep_tree(EMAnnotator* ann, DepTree* parent,
+                          PgfCId* funs, size_t n_funs,
+                          size_t index, size_t n_children,
+                          GuPool* pool)
+{
+	EMState* state = ann->tstate.state;
+
+	DepTree* dtree = gu_malloc(pool, GU_FLEX_SIZE(DepTree, children, n_children));
+	dtree->index      = index;
+	dtree->n_choices  = n_funs;
+	dtree->choices    = gu_new_n(SenseChoice, n_funs, pool);
+	dtree->n_children = n_children;
+
+	size_t n_parent_choices = (parent == NULL) ? 0 : parent->n_choices;
+	for (size_t i = 0; i < n_funs; i++) {
+		SenseChoice* choice = &dtree->choices[i];
+
+		choice->stats =
+			gu_map_get(state->stats, funs[i], FunStats*);
+		if (choice->stats == NULL)
+			return NULL;
+
+		// Only look up the bigrams. The ones which were never seen
+		// get a private ProbCount with the same probability that
+		// init_counts would have given them.
+		choice->prob_counts = gu_new_n(ProbCount*, n_parent_choices, pool);
+		for (size_t j = 0; j < n_parent_choices; j++) {
+			FunStats* head_stats = parent->choices[j].stats;
+
+			ProbCount* pc =
+				gu_map_get(head_stats->mods, funs[i], ProbCount*);
+			if (pc == NULL) {
+				pc = gu_new(ProbCount, pool);
+				pc->prob =
+					state->bigram_smoothing +
+					state->lex->function_prob(state->lex, head_stats->fun) +
+					state->lex->function_prob(state->lex, funs[i]);
+				pc->n_fixed = 0;
+				pc->id = SIZE_MAX;
+			}
+
+			choice->prob_counts[j] = pc;
+		}
+	}
+
+	return dtree;
+}
+
+static void
+tree_scratch_size(DepTree* dtree, size_t* max_index, size_t* n_choices)
+{
+	if (dtree->index > *max_index)
+		*max_index = dtree->index;
+	*n_choices += dtree->n_choices;
+
+	for (size_t i = 0; i < dtree->n_children; i++) {
+		tree_scratch_size(dtree->children[i], max_index, n_choices);
+	}
+}
+
 GuBuf*
-em_annotate_dep_tree(EMState* state, DepTree* dtree, GuPool* pool)
+em_annotator_annotate(EMAnnotator* ann, DepTree* dtree, GuPool* pool)
 {
-	EMThreadState *tstate = &state->threads[0];
+	EMThreadState* tstate = &ann->tstate;
+
+	size_t max_index = 0;
+	size_t n_choices = 0;
+	tree_scratch_size(dtree, &max_index, &n_choices);
+	em_reserve_scratch(tstate, max_index, n_choices, ann->pool);
+
 	tstate->n_estimates = 0;
-	tree_estimation(tstate, dtree, log_max);
+	tree_estimation(tstate, dtree);
 
-	prob_t max = tree_sum_estimation(tstate, dtree, log_max);
+	prob_t max = tree_sum_estimation_max(tstate, dtree);
 	prob_t outside_probs[dtree->n_choices];
 	for (size_t j = 0; j < dtree->n_choices; j++) {
 		outside_probs[j] = -max;
@@ -1453,4 +2862,13 @@ em_annotate_dep_tree(EMState* state, DepTree* dtree, GuPool* pool)
 	return buf;
 }
 
+GuBuf*
+em_annotate_dep_tree(EMState* state, DepTree* dtree, GuPool* pool)
+{
+	EMAnnotator* ann = em_new_annotator(state);
+	GuBuf* buf = em_annotator_annotate(ann, dtree, pool);
+	em_free_annotator(ann);
+	return buf;
+}
+
 
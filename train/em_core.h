@@ -3,7 +3,7 @@
 
 #include <gu/seq.h>
 #include <gu/map.h>
-#include <pgf/pgf.h>
+#include "em_lexicon.h"
 
 #ifndef NUM_THREADS
 #define NUM_THREADS 5
@@ -12,10 +12,13 @@
 typedef struct {
 	prob_t prob;
 	prob_t count[NUM_THREADS];
+	size_t n_fixed;  // the occurrences in compacted subtrees
+	size_t id;       // the position in the list of counts or SIZE_MAX
 } ProbCount;
 
 typedef struct {
 	PgfCId fun;
+	size_t id;  // the position in the iteration order of the lexicon
 	ProbCount pc;
 	GuMap* mods;
 } FunStats;
@@ -40,8 +43,15 @@ typedef void (*EMRankingCallback)(PgfCId lemma, GuSeq* conll, DepTree* dtree,
 
 typedef struct EMState EMState;
 
+#ifndef EM_NO_PGF
 EMState*
 em_new_state(PgfPGF* pgf, prob_t unigram_smoothing, prob_t bigram_smoothing);
+#endif
+
+// The lexicon must stay alive until em_free_state
+EMState*
+em_new_state_lexicon(EMLexicon* lex,
+                     prob_t unigram_smoothing, prob_t bigram_smoothing);
 
 void
 em_free_state(EMState* state);
@@ -49,10 +59,48 @@ em_free_state(EMState* state);
 void
 em_setup_unigram_smoothing(EMState *state, prob_t count);
 
+// The limits for the memory which holds the imported trees, see
+// em_data_stream_configure. Must be called before anything is imported.
+int
+em_configure_data_stream(EMState *state,
+                         size_t region_size, size_t max_elem_size,
+                         size_t max_resident);
+
+// The subtrees in which no node has more than one choice do not depend
+// on the probabilities, so their counts are the same in every step.
+// With this option they are removed from the trees when the trees are
+// added, and their counts are added directly in every step. Compacted
+// trees cannot be exported or annotated, so this is only for training.
+#define EM_OPT_COMPACT 0x01
+
+// Identical trees are stored only once together with the number
+// of copies. As with EM_OPT_COMPACT the copies are lost for export
+// and annotation.
+#define EM_OPT_DEDUP   0x02
+
+// Must be called before anything is imported
+void
+em_set_import_options(EMState *state, int options);
+
+// The number of nodes removed by EM_OPT_COMPACT
+size_t
+em_compacted_count(EMState* state);
+
+// The number of trees which were not stored because of EM_OPT_DEDUP
+size_t
+em_duplicate_count(EMState* state);
+
 DepTree*
 em_new_dep_tree(EMState* state, DepTree* parent, PgfCId fun, GuString lbl,
                 size_t index, size_t n_children);
 
+// The same as em_new_dep_tree but the node is ambiguous between
+// the senses in funs
+DepTree*
+em_new_dep_tree_choices(EMState* state, DepTree* parent,
+                        PgfCId* funs, size_t n_funs, GuString lbl,
+                        size_t index, size_t n_children);
+
 void
 em_start_dep_tree(EMState* state);
 
@@ -62,6 +110,21 @@ em_add_dep_tree(EMState* state, DepTree* dtree);
 void
 em_increment_count(EMState* state, PgfCId fun);
 
+// Imports many trees with a single call. The buffer is a sequence of:
+//
+//   'T' node            - a tree, added like with em_add_dep_tree
+//   'C' fun '\0'        - the same as em_increment_count(state, fun)
+//
+// where a node is the number of children as a uint32_t in native
+// byte order, the function name terminated with '\0', and then
+// the children. The nodes are indexed in pre-order.
+int
+em_import_packed_trees(EMState* state, const uint8_t* buf, size_t len);
+
+// The same but the packed trees are read from a file
+int
+em_import_packed_file(EMState* state, GuString fpath);
+
 int
 em_import_treebank(EMState* state, GuString fpath, GuString lang);
 
@@ -82,6 +145,58 @@ em_set_ranking_callback(EMState* state,
 prob_t
 em_step(EMState *state);
 
+// Distributed training. Every worker imports its own part of the data
+// and then repeatedly writes its counts with em_write_counts, waits for
+// the coordinator to merge the counts from all workers and publish them
+// with em_write_probs, loads them with em_read_probs and runs
+// em_estimate. The functions are identified by their position in the
+// lexicon, so all processes must use the same grammar. The files are
+// written under a temporary name and then renamed.
+
+// The E-step only, with the probabilities from em_read_probs.
+// Returns the log probability of the local part of the data.
+prob_t
+em_estimate(EMState *state);
+
+int
+em_write_counts(EMState *state, GuString fpath);
+
+int
+em_read_probs(EMState *state, GuString fpath, int* finished);
+
+// Sums the counts from the workers into the probabilities of this state
+// and computes the corpus probability for the previous estimation.
+int
+em_merge_counts(EMState *state, GuString* fpaths, size_t n_fpaths,
+                prob_t* corpus_prob);
+
+int
+em_write_probs(EMState *state, GuString fpath, int finished);
+
+typedef enum {
+	EM_PHASE_NORMALIZE,  // turning the counts into probabilities
+	EM_PHASE_FETCH,      // em_data_stream_fetch_element incl. region remaps
+	EM_PHASE_INSIDE,     // tree_estimation
+	EM_PHASE_OUTSIDE,    // tree_counting
+	EM_PHASE_BARRIER,    // waiting for the other threads
+	EM_N_PHASES
+} EMPhase;
+
+// Statistics for the last call to em_step for a single thread.
+// The time is in nanoseconds.
+typedef struct {
+	uint64_t time[EM_N_PHASES];
+	size_t n_trees;
+	size_t n_edges;
+	size_t n_choices;
+} EMThreadStats;
+
+void
+em_get_thread_stats(EMState *state, size_t thread_idx, EMThreadStats* stats);
+
+int
+em_dump_stats(EMState *state, GuString fpath, int iteration);
+
 void
 em_dump(EMState *state, char* unigram_path, char* bigram_path);
 
@@ -100,9 +215,37 @@ typedef struct {
 	prob_t prob;
 } EMLemmaProb;
 
+// The same as annotating with a temporary annotator, see below
 GuBuf*
 em_annotate_dep_tree(EMState* state, DepTree* dtree, GuPool* pool);
 
+// A context for annotating trees with the current model. Every
+// annotator has its own scratch buffers and only reads the model,
+// so several threads can annotate at the same time, each with its
+// own annotator. Nothing may train or import at the same time.
+typedef struct EMAnnotator EMAnnotator;
+
+EMAnnotator*
+em_new_annotator(EMState* state);
+
+void
+em_free_annotator(EMAnnotator* ann);
+
+// Builds a node of a tree for annotation in the given pool. Unlike
+// em_new_dep_tree_choices, this neither changes the counts nor uses
+// the stream of trees. Returns NULL if one of funs is unknown.
+DepTree*
+em_annotator_new_dep_tree(EMAnnotator* ann, DepTree* parent,
+                          PgfCId* funs, size_t n_funs,
+                          size_t index, size_t n_children,
+                          GuPool* pool);
+
+// Returns the choices of every node as EMLemmaProb, allocated in pool
+GuBuf*
+em_annotator_annotate(EMAnnotator* ann, DepTree* dtree, GuPool* pool);
+
+// The trees are annotated by all threads and printed in
+// the order in which they were added.
 int
 em_export_abstract_treebank(EMState* state, GuString fpath);
 
@@ -8,22 +8,33 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <pthread.h>
+#include <errno.h>
+#include <stdbool.h>
 #include "em_data_stream.h"
 
-#define DATA_STREAM_FILE "/tmp/em_data_stream"
+// Every process gets its own file, so that several workers
+// can run on the same machine
+#define DATA_STREAM_FILE "/tmp/em_data_stream_XXXXXX"
 
 struct EMDataStream {
+	GuPool* pool;
 	int fd;
 	size_t n_regions;
 	void* region;
+	size_t i_mapped;  // the index of the region which is mapped now
 
 	size_t region_size;
 	size_t max_elem_size;
+	size_t n_resident;  // the number of regions kept in memory or 0
 	uint8_t* start;
 	uint8_t* end;
+	uint8_t* elem_end;  // end when the current element was started
 
 	size_t i_elem;
 	size_t i_region;
+	size_t i_first;  // the number of elements before the current region
+
+	EMDataStreamStats stats;
 
 	pthread_barrier_t barrier1, barrier2;
 };
@@ -33,23 +44,42 @@ em_new_data_stream(size_t region_size, size_t max_elem_size, size_t n_threads,
                    GuPool* pool, GuExn* err)
 {
 	EMDataStream* stream = gu_new(EMDataStream, pool);
+	stream->pool = pool;
 
-	stream->fd = open(DATA_STREAM_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+	char fpath[] = DATA_STREAM_FILE;
+	stream->fd = mkstemp(fpath);
 	if (stream->fd < 0) {
 		gu_raise_errno(err);
 		return NULL;
 	}
 
-	size_t pagesize = getpagesize();
-	
+	// The file is only accessed through the descriptor, and this way
+	// it disappears even if the process crashes.
+	if (unlink(fpath) != 0) {
+		gu_raise_errno(err);
+		close(stream->fd);
+		return NULL;
+	}
+
 	stream->n_regions    = 0;
 	stream->region       = NULL;
-	stream->region_size  = ((region_size + pagesize-1) / pagesize)*pagesize;
-	stream->max_elem_size= max_elem_size;
+	stream->i_mapped     = 0;
 	stream->start = NULL;
 	stream->end   = NULL;
+	stream->elem_end = NULL;
 	stream->i_elem   = 0;
 	stream->i_region = 0;
+	stream->i_first  = 0;
+	stream->stats.n_remaps       = 0;
+	stream->stats.bytes_mapped   = 0;
+	stream->stats.bytes_released = 0;
+	stream->stats.bytes_overflow = 0;
+
+	em_data_stream_configure(stream, region_size, max_elem_size, 0, err);
+	if (gu_exn_is_raised(err)) {
+		close(stream->fd);
+		return NULL;
+	}
 
 	if ((errno = pthread_barrier_init(&stream->barrier1, NULL, n_threads)) != 0) {
 		gu_raise_errno(err);
@@ -64,6 +94,55 @@ em_new_data_stream(size_t region_size, size_t max_elem_size, size_t n_threads,
 	return stream;
 }
 
+void
+em_data_stream_configure(EMDataStream* stream,
+                         size_t region_size, size_t max_elem_size,
+                         size_t max_resident, GuExn* err)
+{
+	if (stream->n_regions > 0) {
+		errno = EBUSY;
+		gu_raise_errno(err);
+		return;
+	}
+
+	size_t pagesize = getpagesize();
+	region_size = ((region_size + pagesize-1) / pagesize)*pagesize;
+
+	// the region starts with the number of elements
+	if (max_elem_size + 2*sizeof(size_t) > region_size) {
+		errno = EINVAL;
+		gu_raise_errno(err);
+		return;
+	}
+
+	stream->region_size   = region_size;
+	stream->max_elem_size = max_elem_size;
+	stream->n_resident    = (max_resident == 0) ? 0 : max_resident / region_size;
+	if (max_resident > 0 && stream->n_resident == 0)
+		stream->n_resident = 1;
+}
+
+// Called when we are done with the region which is currently mapped.
+// If it is beyond the memory budget, then it is removed from both
+// the address space and the page cache. The next pass will read it
+// from the disk again.
+static void
+em_data_stream_release(EMDataStream* stream, bool dirty)
+{
+	if (stream->n_resident == 0 || stream->i_mapped < stream->n_resident)
+		return;
+
+	// dirty pages must be written before they can be dropped
+	if (dirty)
+		msync(stream->region, stream->region_size, MS_SYNC);
+
+	madvise(stream->region, stream->region_size, MADV_DONTNEED);
+	posix_fadvise(stream->fd, stream->i_mapped*stream->region_size,
+	              stream->region_size, POSIX_FADV_DONTNEED);
+
+	stream->stats.bytes_released += stream->region_size;
+}
+
 void
 em_data_stream_start_element(EMDataStream* stream, GuExn* err)
 {
@@ -90,6 +169,8 @@ em_data_stream_start_element(EMDataStream* stream, GuExn* err)
 				return;
 			}
 
+			em_data_stream_release(stream, false);
+
 			void* region = mmap(stream->region, stream->region_size,
 								PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,
 								stream->fd, offset);
@@ -99,13 +180,24 @@ em_data_stream_start_element(EMDataStream* stream, GuExn* err)
 			}
 		}
 
+		stream->i_mapped = stream->n_regions;
 		stream->n_regions++;
+		stream->stats.n_remaps++;
+		stream->stats.bytes_mapped += stream->region_size;
 		stream->start = stream->region;
 		stream->end   = stream->start + stream->region_size;
 
 		*((size_t*) stream->start) = 0;
 		stream->start += sizeof(size_t);
 	}
+
+	stream->elem_end = stream->end;
+}
+
+void
+em_data_stream_discard_element(EMDataStream* stream)
+{
+	stream->end = stream->elem_end;
 }
 
 void
@@ -119,9 +211,12 @@ em_data_stream_add_element(EMDataStream* stream, void* elem)
 void*
 em_data_stream_malloc(EMDataStream* stream, size_t size)
 {
-	if (stream->start+size > stream->end) {
-		printf("em_data_stream_malloc failed (requested %ld, available %ld): increase max_elem_size\n", size, stream->end-stream->start);
-		exit(1);
+	// There must be space left for the pointer to the element.
+	// If there isn't then the rest of the element spills over into
+	// memory that stays allocated for the lifetime of the stream.
+	if (stream->start+sizeof(void*)+size > stream->end) {
+		stream->stats.bytes_overflow += size;
+		return gu_malloc(stream->pool, size);
 	}
 
 	stream->end -= size;
@@ -132,6 +227,12 @@ void
 em_data_stream_restart(EMDataStream* stream, size_t thread_idx, GuExn* err)
 {
 	if (thread_idx == 0) {
+		if (stream->region == NULL)
+			return;
+
+		// the last region may still be written to
+		em_data_stream_release(stream, true);
+
 		void* region = mmap(stream->region, stream->region_size,
 							PROT_READ,MAP_SHARED|MAP_FIXED,
 							stream->fd, 0);
@@ -140,13 +241,26 @@ em_data_stream_restart(EMDataStream* stream, size_t thread_idx, GuExn* err)
 			return;
 		}
 
+		stream->i_mapped = 0;
+		stream->stats.n_remaps++;
+		stream->stats.bytes_mapped += stream->region_size;
+
 		stream->i_elem   = 0;
 		stream->i_region = 0;
+		stream->i_first  = 0;
 	}
 }
 
 void*
 em_data_stream_fetch_element(EMDataStream* stream, size_t thread_idx)
+{
+	size_t index;
+	return em_data_stream_fetch_indexed_element(stream, thread_idx, &index);
+}
+
+void*
+em_data_stream_fetch_indexed_element(EMDataStream* stream, size_t thread_idx,
+                                     size_t* index)
 {
 	if (stream->region == NULL)
 		return NULL;
@@ -160,10 +274,13 @@ em_data_stream_fetch_element(EMDataStream* stream, size_t thread_idx)
 		pthread_barrier_wait(&stream->barrier1);
 
 		if (thread_idx == 0) {
+			stream->i_first += *((size_t*) stream->region);
 			stream->i_region++;
 			stream->i_elem = 0;
 
 			if (stream->i_region < stream->n_regions) {
+				em_data_stream_release(stream, false);
+
 				off_t offset = stream->i_region*stream->region_size;
 				void* region = mmap(stream->region, stream->region_size,
 									PROT_READ,MAP_SHARED|MAP_FIXED,
@@ -171,6 +288,10 @@ em_data_stream_fetch_element(EMDataStream* stream, size_t thread_idx)
 				if (region != stream->region) {
 					stream->region = NULL;
 				}
+
+				stream->i_mapped = stream->i_region;
+				stream->stats.n_remaps++;
+				stream->stats.bytes_mapped += stream->region_size;
 			}
 		}
 
@@ -180,9 +301,24 @@ em_data_stream_fetch_element(EMDataStream* stream, size_t thread_idx)
 			return NULL;
 	}
 
+	*index = stream->i_first + i;
 	return *((void**) (stream->region+sizeof(size_t)+i*sizeof(void*)));
 }
 
+void
+em_data_stream_get_stats(EMDataStream* stream, EMDataStreamStats* stats)
+{
+	*stats = stream->stats;
+}
+
+void
+em_data_stream_reset_stats(EMDataStream* stream)
+{
+	stream->stats.n_remaps       = 0;
+	stream->stats.bytes_mapped   = 0;
+	stream->stats.bytes_released = 0;
+}
+
 void
 em_data_stream_close(EMDataStream* stream, GuExn* err)
 {
@@ -202,9 +338,5 @@ em_data_stream_close(EMDataStream* stream, GuExn* err)
 		gu_raise_errno(err);
 		return;
 	}
-	if (remove(DATA_STREAM_FILE) != 0) {
-		gu_raise_errno(err);
-		return;
-	}
 }
 
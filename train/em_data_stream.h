@@ -6,10 +6,28 @@
 
 typedef struct EMDataStream EMDataStream;
 
+typedef struct {
+	size_t n_remaps;
+	size_t bytes_mapped;
+	size_t bytes_released;  // dropped from memory after use
+	size_t bytes_overflow;  // for elements larger than max_elem_size,
+	                        // this is not reset by em_data_stream_reset_stats
+} EMDataStreamStats;
+
 EMDataStream*
 em_new_data_stream(size_t region_size, size_t max_elem_size, size_t n_threads,
                    GuPool* pool, GuExn* err);
 
+// Changes the limits of a stream which is still empty.
+// Elements which need more than max_elem_size are partly allocated
+// outside of the stream. If max_resident is not zero then only that many
+// bytes of the stream stay in memory between the iterations, and
+// the rest of the regions are dropped from the page cache after use.
+void
+em_data_stream_configure(EMDataStream* stream,
+                         size_t region_size, size_t max_elem_size,
+                         size_t max_resident, GuExn* err);
+
 void
 em_data_stream_start_element(EMDataStream* stream, GuExn* err);
 
@@ -19,12 +37,31 @@ em_data_stream_add_element(EMDataStream* stream, void* elem);
 void*
 em_data_stream_malloc(EMDataStream* stream, size_t size);
 
+// Frees the memory allocated since the last em_data_stream_start_element
+// instead of adding the element. The memory allocated outside of
+// the stream is not freed.
+void
+em_data_stream_discard_element(EMDataStream* stream);
+
 void
 em_data_stream_restart(EMDataStream* stream, size_t thread_idx, GuExn* err);
 
 void*
 em_data_stream_fetch_element(EMDataStream* stream, size_t thread_idx);
 
+// The same as em_data_stream_fetch_element but it also returns
+// the position of the element in the stream, counting from zero.
+// Each thread gets the elements in increasing order.
+void*
+em_data_stream_fetch_indexed_element(EMDataStream* stream, size_t thread_idx,
+                                     size_t* index);
+
+void
+em_data_stream_get_stats(EMDataStream* stream, EMDataStreamStats* stats);
+
+void
+em_data_stream_reset_stats(EMDataStream* stream);
+
 void
 em_data_stream_close(EMDataStream* stream, GuExn* err);
 
@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <gu/seq.h>
+#include "em_lexicon.h"
+
+#ifndef EM_NO_PGF
+typedef struct {
+	EMLexicon base;
+	PgfPGF* pgf;
+} PgfLexicon;
+
+static PgfCId
+pgf_lexicon_function_cat(EMLexicon* lex, PgfCId fun, size_t* arity)
+{
+	PgfLexicon* self = gu_container(lex, PgfLexicon, base);
+	PgfType* ty = pgf_function_type(self->pgf, fun);
+	if (ty == NULL)
+		return NULL;
+	*arity = gu_seq_length(ty->hypos);
+	return ty->cid;
+}
+
+static prob_t
+pgf_lexicon_function_prob(EMLexicon* lex, PgfCId fun)
+{
+	PgfLexicon* self = gu_container(lex, PgfLexicon, base);
+	PgfType* ty = pgf_function_type(self->pgf, fun);
+	if (ty == NULL)
+		return INFINITY;
+	return pgf_category_prob(self->pgf, ty->cid) +
+	       pgf_function_prob(self->pgf, fun);
+}
+
+static void
+pgf_lexicon_iter_functions(EMLexicon* lex, GuMapItor* itor, GuExn* err)
+{
+	PgfLexicon* self = gu_container(lex, PgfLexicon, base);
+	pgf_iter_functions(self->pgf, itor, err);
+}
+
+static EMLanguage*
+pgf_lexicon_get_language(EMLexicon* lex, GuString name)
+{
+	PgfLexicon* self = gu_container(lex, PgfLexicon, base);
+	return (EMLanguage*) pgf_get_language(self->pgf, name);
+}
+
+typedef struct {
+	PgfMorphoCallback base;
+	EMMorphoCallback* callback;
+} PgfLexiconMorphoCallback;
+
+static void
+pgf_lexicon_morpho_callback(PgfMorphoCallback* callback,
+                            PgfCId lemma, GuString analysis, prob_t prob,
+                            GuExn* err)
+{
+	PgfLexiconMorphoCallback* self =
+		gu_container(callback, PgfLexiconMorphoCallback, base);
+	self->callback->callback(self->callback, lemma, err);
+}
+
+static void
+pgf_lexicon_lookup_morpho(EMLexicon* lex, EMLanguage* lang,
+                          GuString form, EMMorphoCallback* callback,
+                          GuExn* err)
+{
+	PgfLexiconMorphoCallback clo;
+	clo.base.callback = pgf_lexicon_morpho_callback;
+	clo.callback      = callback;
+	pgf_lookup_morpho((PgfConcr*) lang, form, &clo.base, err);
+}
+
+EMLexicon*
+em_new_pgf_lexicon(PgfPGF* pgf, GuPool* pool)
+{
+	PgfLexicon* self = gu_new(PgfLexicon, pool);
+	self->base.function_cat   = pgf_lexicon_function_cat;
+	self->base.function_prob  = pgf_lexicon_function_prob;
+	self->base.iter_functions = pgf_lexicon_iter_functions;
+	self->base.get_language   = pgf_lexicon_get_language;
+	self->base.lookup_morpho  = pgf_lexicon_lookup_morpho;
+	self->pgf = pgf;
+	return &self->base;
+}
+#endif
+
+typedef struct {
+	PgfCId cat;
+	size_t arity;
+	prob_t prob;
+} TSVFunction;
+
+typedef struct {
+	EMLexicon base;
+	GuMap* funs;   // PgfCId -> TSVFunction
+	GuMap* forms;  // GuString -> GuBuf* of PgfCId
+	prob_t cat_prob;
+} TSVLexicon;
+
+static PgfCId
+tsv_lexicon_function_cat(EMLexicon* lex, PgfCId fun, size_t* arity)
+{
+	TSVLexicon* self = gu_container(lex, TSVLexicon, base);
+	TSVFunction* entry = gu_map_find(self->funs, fun);
+	if (entry == NULL)
+		return NULL;
+	*arity = entry->arity;
+	return entry->cat;
+}
+
+static prob_t
+tsv_lexicon_function_prob(EMLexicon* lex, PgfCId fun)
+{
+	TSVLexicon* self = gu_container(lex, TSVLexicon, base);
+	TSVFunction* entry = gu_map_find(self->funs, fun);
+	if (entry == NULL)
+		return INFINITY;
+	return self->cat_prob + entry->prob;
+}
+
+static void
+tsv_lexicon_iter_functions(EMLexicon* lex, GuMapItor* itor, GuExn* err)
+{
+	TSVLexicon* self = gu_container(lex, TSVLexicon, base);
+	gu_map_iter(self->funs, itor, err);
+}
+
+static EMLanguage*
+tsv_lexicon_get_language(EMLexicon* lex, GuString name)
+{
+	return (EMLanguage*) lex;
+}
+
+static void
+tsv_lexicon_lookup_morpho(EMLexicon* lex, EMLanguage* lang,
+                          GuString form, EMMorphoCallback* callback,
+                          GuExn* err)
+{
+	TSVLexicon* self = gu_container(lex, TSVLexicon, base);
+	GuBuf* lemmas = gu_map_get(self->forms, form, GuBuf*);
+	if (lemmas == NULL)
+		return;
+
+	for (size_t i = 0; i < gu_buf_length(lemmas); i++) {
+		callback->callback(callback, gu_buf_get(lemmas, PgfCId, i), err);
+	}
+}
+
+static void
+tsv_lexicon_error(GuExn* err, GuString fpath, size_t line_no,
+                  const char* msg)
+{
+	fprintf(stderr, "%s:%zu: %s\n", fpath, line_no, msg);
+	errno = EINVAL;
+	gu_raise_errno(err);
+}
+
+// Splits the category column into the result category and the arity.
+// Everything before the last arrow is counted as an argument.
+static char*
+tsv_lexicon_parse_type(char* type, size_t* arity)
+{
+	*arity = 0;
+
+	char* cat = type;
+	char* arrow;
+	while ((arrow = strstr(cat, "->")) != NULL) {
+		(*arity)++;
+		cat = arrow+2;
+	}
+
+	while (*cat == ' ')
+		cat++;
+	char* end = cat+strlen(cat);
+	while (end > cat && end[-1] == ' ')
+		end--;
+	*end = 0;
+
+	return cat;
+}
+
+EMLexicon*
+em_read_tsv_lexicon(GuString fpath, GuPool* pool, GuExn* err)
+{
+	FILE* inp = fopen(fpath, "r");
+	if (inp == NULL) {
+		gu_raise_errno(err);
+		return NULL;
+	}
+
+	TSVLexicon* self = gu_new(TSVLexicon, pool);
+	self->base.function_cat   = tsv_lexicon_function_cat;
+	self->base.function_prob  = tsv_lexicon_function_prob;
+	self->base.iter_functions = tsv_lexicon_iter_functions;
+	self->base.get_language   = tsv_lexicon_get_language;
+	self->base.lookup_morpho  = tsv_lexicon_lookup_morpho;
+	self->funs  = gu_new_string_map(TSVFunction, NULL, pool);
+	self->forms = gu_new_string_map(GuBuf*, NULL, pool);
+
+	GuMap* cats = gu_new_string_map(int, NULL, pool);
+
+	size_t line_no = 0;
+	char line[4096];
+	while (fgets(line, sizeof(line), inp)) {
+		line_no++;
+
+		size_t len = strlen(line);
+		if (len < 1 || line[len-1] != '\n') {
+			if (!feof(inp)) {
+				tsv_lexicon_error(err, fpath, line_no, "line too long");
+				fclose(inp);
+				return NULL;
+			}
+		} else {
+			line[--len] = 0;
+		}
+
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		char* saveptr;
+		char* name = strtok_r(line, "\t", &saveptr);
+		char* type = strtok_r(NULL, "\t", &saveptr);
+		char* prob = strtok_r(NULL, "\t", &saveptr);
+		if (name == NULL || type == NULL || prob == NULL) {
+			tsv_lexicon_error(err, fpath, line_no, "too few fields");
+			fclose(inp);
+			return NULL;
+		}
+
+		double p = atof(prob);
+		if (!(p > 0 && p <= 1)) {
+			tsv_lexicon_error(err, fpath, line_no, "the probability is not in (0,1]");
+			fclose(inp);
+			return NULL;
+		}
+
+		if (gu_map_find(self->funs, name) != NULL) {
+			tsv_lexicon_error(err, fpath, line_no, "duplicate function");
+			fclose(inp);
+			return NULL;
+		}
+
+		PgfCId fun = gu_string_copy(name, pool);
+		TSVFunction* entry = gu_map_insert(self->funs, fun);
+		entry->prob = -log(p);
+
+		// all functions of the same category share the name
+		PgfCId cat = tsv_lexicon_parse_type(type, &entry->arity);
+		const PgfCId* pcat = gu_map_find_key(cats, cat);
+		if (pcat == NULL) {
+			cat = gu_string_copy(cat, pool);
+			gu_map_insert(cats, cat);
+		} else {
+			cat = *pcat;
+		}
+		entry->cat = cat;
+
+		char* form;
+		while ((form = strtok_r(NULL, "\t", &saveptr)) != NULL) {
+			GuBuf** lemmas = gu_map_find(self->forms, form);
+			if (lemmas == NULL) {
+				lemmas = gu_map_insert(self->forms,
+				                       gu_string_copy(form, pool));
+				*lemmas = gu_new_buf(PgfCId, pool);
+			}
+
+			size_t n_lemmas = gu_buf_length(*lemmas);
+			if (n_lemmas == 0 ||
+			    gu_buf_get(*lemmas, PgfCId, n_lemmas-1) != fun)
+				gu_buf_push(*lemmas, PgfCId, fun);
+		}
+	}
+
+	if (ferror(inp)) {
+		gu_raise_errno(err);
+		fclose(inp);
+		return NULL;
+	}
+	fclose(inp);
+
+	size_t n_cats = gu_map_count(cats);
+	self->cat_prob = (n_cats > 0) ? log(n_cats) : 0;
+
+	return &self->base;
+}
+
+EMLexicon*
+em_open_lexicon(GuString fpath, GuPool* pool, GuExn* err)
+{
+#ifndef EM_NO_PGF
+	size_t len = strlen(fpath);
+	if (len > 4 && strcmp(fpath+len-4, ".pgf") == 0) {
+		PgfPGF* pgf = pgf_read(fpath, pool, err);
+		if (gu_exn_is_raised(err))
+			return NULL;
+		return em_new_pgf_lexicon(pgf, pool);
+	}
+#endif
+	return em_read_tsv_lexicon(fpath, pool, err);
+}
@@ -0,0 +1,75 @@
+#ifndef EM_LEXICON_H
+#define EM_LEXICON_H
+
+#include <gu/mem.h>
+#include <gu/map.h>
+#include <gu/exn.h>
+#include <gu/string.h>
+
+// When the EM core is compiled with -DEM_NO_PGF it does not depend
+// on the GF runtime and the lexicon must come from some other provider,
+// for instance em_read_tsv_lexicon.
+#ifndef EM_NO_PGF
+#include <pgf/pgf.h>
+#else
+typedef GuString PgfCId;
+typedef float prob_t;
+#endif
+
+typedef struct EMLanguage EMLanguage;
+
+typedef struct EMMorphoCallback EMMorphoCallback;
+
+struct EMMorphoCallback {
+	void (*callback)(EMMorphoCallback* self, PgfCId lemma, GuExn* err);
+};
+
+// The lexicon and the probabilities that the EM core needs to know
+// about the grammar. The PGF provider simply forwards to the GF runtime.
+typedef struct EMLexicon EMLexicon;
+
+struct EMLexicon {
+	// The category of fun or NULL if fun is unknown.
+	// The number of arguments is stored in arity.
+	PgfCId (*function_cat)(EMLexicon* lex, PgfCId fun, size_t* arity);
+
+	// The negative log probability of fun, i.e. the probability
+	// of its category plus the probability of fun within the category.
+	prob_t (*function_prob)(EMLexicon* lex, PgfCId fun);
+
+	// Calls itor for every function. The key is the function name.
+	void (*iter_functions)(EMLexicon* lex, GuMapItor* itor, GuExn* err);
+
+	EMLanguage* (*get_language)(EMLexicon* lex, GuString name);
+
+	// Calls the callback with the lemma of every analysis of form.
+	// em_import_treebank calls it from several threads at once.
+	void (*lookup_morpho)(EMLexicon* lex, EMLanguage* lang,
+	                      GuString form, EMMorphoCallback* callback,
+	                      GuExn* err);
+};
+
+#ifndef EM_NO_PGF
+EMLexicon*
+em_new_pgf_lexicon(PgfPGF* pgf, GuPool* pool);
+#endif
+
+// Reads a lexicon from a tab separated file with one function per line:
+//
+//    function  category  probability  form1  form2 ...
+//
+// The category can also be a full type, e.g. "A -> CN -> CN",
+// in which case the function is not lexical. The probability is
+// the probability of the function within its category and all
+// categories are equally likely. The file describes a single language,
+// so get_language succeeds for any name.
+EMLexicon*
+em_read_tsv_lexicon(GuString fpath, GuPool* pool, GuExn* err);
+
+// Reads the lexicon from a grammar if the file name ends with .pgf
+// and with em_read_tsv_lexicon otherwise. Without the GF runtime
+// every file is read as a tab separated lexicon.
+EMLexicon*
+em_open_lexicon(GuString fpath, GuPool* pool, GuExn* err);
+
+#endif
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sense_embedding.h"
+
+int
+sense_embedding_open(SenseEmbedding* emb, const char* fpath)
+{
+	int fd = open(fpath, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Error opening %s\n", fpath);
+		return 0;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(SenseEmbeddingHeader)) {
+		fprintf(stderr, "%s is not an embedding\n", fpath);
+		close(fd);
+		return 0;
+	}
+
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Error reading %s\n", fpath);
+		return 0;
+	}
+
+	const SenseEmbeddingHeader* header = data;
+	size_t n_funs = header->n_funs;
+	size_t n_components = header->n_components;
+	size_t size = sizeof(SenseEmbeddingHeader) +
+	              sizeof(uint64_t)*n_funs +
+	              sizeof(float)*n_components*(1+2*n_funs) +
+	              header->names_size;
+	if (header->magic != SENSE_EMBEDDING_MAGIC || size != st.st_size) {
+		fprintf(stderr, "%s is not an embedding\n", fpath);
+		munmap(data, st.st_size);
+		return 0;
+	}
+
+	emb->data = data;
+	emb->size = st.st_size;
+	emb->n_components = n_components;
+	emb->n_funs       = n_funs;
+	emb->name_offsets = (const uint64_t*) (header+1);
+	emb->weights      = (const float*) (emb->name_offsets + n_funs);
+	emb->heads        = emb->weights + n_components;
+	emb->mods         = emb->heads + n_components*n_funs;
+	emb->names        = (const char*) (emb->mods + n_components*n_funs);
+	return 1;
+}
+
+void
+sense_embedding_close(SenseEmbedding* emb)
+{
+	munmap(emb->data, emb->size);
+	emb->data = NULL;
+}
+
+long
+sense_embedding_lookup(SenseEmbedding* emb, const char* fun)
+{
+	size_t lo = 0;
+	size_t hi = emb->n_funs;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		int cmp = strcmp(fun, sense_embedding_name(emb, mid));
+		if (cmp == 0)
+			return mid;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid+1;
+	}
+	return -1;
+}
+
+const char*
+sense_embedding_name(SenseEmbedding* emb, size_t index)
+{
+	return emb->names + emb->name_offsets[index];
+}
+
+const float*
+sense_embedding_head(SenseEmbedding* emb, size_t index)
+{
+	return emb->heads + index*emb->n_components;
+}
+
+const float*
+sense_embedding_mod(SenseEmbedding* emb, size_t index)
+{
+	return emb->mods + index*emb->n_components;
+}
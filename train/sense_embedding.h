@@ -0,0 +1,64 @@
+#ifndef SENSE_EMBEDDING_H
+#define SENSE_EMBEDDING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The binary file with the sense embeddings which sense_nmf writes.
+// It is meant to be memory mapped, so everything is in native byte
+// order and aligned. After the header follow:
+//
+//   uint64_t name_offsets[n_funs]  - the offsets of the names in names
+//   float    weights[n_components] - the weight of every component
+//   float    heads[n_funs][n_components]
+//   float    mods[n_funs][n_components]
+//   char     names[names_size]     - NUL terminated
+//
+// The functions are sorted by name. The vectors for a function as
+// a head and as a modifier are normalized per component, i.e.
+// every column sums up to one, and the weights sum up to one.
+
+#define SENSE_EMBEDDING_MAGIC 0x31424d45  // "EMB1"
+
+typedef struct {
+	uint32_t magic;
+	uint32_t n_components;
+	uint64_t n_funs;
+	uint64_t names_size;
+} SenseEmbeddingHeader;
+
+typedef struct {
+	void* data;
+	size_t size;
+
+	size_t n_components;
+	size_t n_funs;
+	const uint64_t* name_offsets;
+	const float* weights;
+	const float* heads;
+	const float* mods;
+	const char* names;
+} SenseEmbedding;
+
+// Maps the file into memory. Returns 0 and prints a message
+// if the file cannot be read or is not an embedding.
+int
+sense_embedding_open(SenseEmbedding* emb, const char* fpath);
+
+void
+sense_embedding_close(SenseEmbedding* emb);
+
+// The index of fun or -1 if it is not in the embedding
+long
+sense_embedding_lookup(SenseEmbedding* emb, const char* fun);
+
+const char*
+sense_embedding_name(SenseEmbedding* emb, size_t index);
+
+const float*
+sense_embedding_head(SenseEmbedding* emb, size_t index);
+
+const float*
+sense_embedding_mod(SenseEmbedding* emb, size_t index);
+
+#endif
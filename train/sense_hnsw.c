@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sense_index.h"
+
+// Builds the similarity index over an embedding from sense_nmf.
+// With --check the index is compared with exhaustive search
+// on a sample of the functions and the recall is reported.
+
+static void
+usage()
+{
+	fprintf(stderr,
+	        "Syntax: sense_hnsw <embedding.bin> <embedding.hnsw>\n"
+	        "                   [--links N] [--ef N] [--seed N] [--check N]\n");
+	exit(1);
+}
+
+static float
+exact_distance(SenseIndex* idx, size_t i, size_t j)
+{
+	SenseEmbedding* emb = idx->emb;
+	const float* head_i = sense_embedding_head(emb, i);
+	const float* head_j = sense_embedding_head(emb, j);
+	const float* mod_i  = sense_embedding_mod(emb, i);
+	const float* mod_j  = sense_embedding_mod(emb, j);
+
+	float dot = 0;
+	for (size_t k = 0; k < emb->n_components; k++) {
+		dot += idx->weights2[k]*(head_i[k]*head_j[k] + mod_i[k]*mod_j[k]);
+	}
+
+	float norm = idx->norms[i]*idx->norms[j];
+	return (norm > 0) ? 1 - dot/norm : 1;
+}
+
+static int
+cmp_dist(const void* p1, const void* p2)
+{
+	float d1 = *((const float*) p1);
+	float d2 = *((const float*) p2);
+	return (d1 > d2) - (d1 < d2);
+}
+
+static void
+check_recall(SenseIndex* idx, size_t n_queries, size_t k)
+{
+	size_t n_funs = idx->emb->n_funs;
+	if (n_funs <= k)
+		return;
+
+	float* dists = malloc(sizeof(float)*n_funs);
+	SenseNeighbour* result = malloc(sizeof(SenseNeighbour)*k);
+	SenseSearch search;
+	if (dists == NULL || result == NULL || !sense_search_init(&search, idx)) {
+		fprintf(stderr, "Not enough memory for checking the index\n");
+		free(result);
+		free(dists);
+		return;
+	}
+
+	size_t n_found = 0;
+	clock_t search_time = 0;
+	for (size_t q = 0; q < n_queries; q++) {
+		size_t query = (q * 2654435761u) % n_funs;
+
+		clock_t start = clock();
+		size_t n = sense_index_search(idx, &search, query, k, 10*k, result);
+		search_time += clock() - start;
+
+		size_t n_dists = 0;
+		for (size_t i = 0; i < n_funs; i++) {
+			if (i != query)
+				dists[n_dists++] = exact_distance(idx, query, i);
+		}
+		qsort(dists, n_dists, sizeof(float), cmp_dist);
+
+		// Ties are counted as found
+		for (size_t i = 0; i < n; i++) {
+			if (result[i].dist <= dists[k-1])
+				n_found++;
+		}
+	}
+
+	printf("recall@%zu %.3f, %.3f ms per query\n",
+	       k, ((double) n_found) / (n_queries*k),
+	       1000.0 * search_time / CLOCKS_PER_SEC / n_queries);
+
+	sense_search_free(&search);
+	free(result);
+	free(dists);
+}
+
+int
+main(int argc, char* argv[])
+{
+	if (argc < 3)
+		usage();
+
+	size_t M = 16;
+	size_t ef_construction = 200;
+	uint64_t seed = 42;
+	size_t n_checks = 0;
+
+	for (int i = 3; i < argc; i++) {
+		if (i+1 >= argc)
+			usage();
+
+		if (strcmp(argv[i], "--links") == 0)
+			M = atol(argv[++i]);
+		else if (strcmp(argv[i], "--ef") == 0)
+			ef_construction = atol(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0)
+			seed = atol(argv[++i]);
+		else if (strcmp(argv[i], "--check") == 0)
+			n_checks = atol(argv[++i]);
+		else
+			usage();
+	}
+	if (M < 2 || ef_construction == 0 || seed == 0)
+		usage();
+
+	SenseEmbedding emb;
+	if (!sense_embedding_open(&emb, argv[1]))
+		return 1;
+
+	SenseIndex idx;
+	if (!sense_index_build(&idx, &emb, M, ef_construction, seed)) {
+		fprintf(stderr, "Not enough memory for the index\n");
+		sense_embedding_close(&emb);
+		return 1;
+	}
+
+	int ok = sense_index_write(&idx, argv[2]);
+	if (ok && n_checks > 0)
+		check_recall(&idx, n_checks, 10);
+
+	sense_index_close(&idx);
+	sense_embedding_close(&emb);
+	return ok ? 0 : 1;
+}
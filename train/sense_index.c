@@ -0,0 +1,613 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sense_index.h"
+
+static inline float
+node_distance(SenseIndex* idx, size_t i, size_t j)
+{
+	size_t n_components = idx->emb->n_components;
+	const float* head_i = idx->emb->heads + i*n_components;
+	const float* head_j = idx->emb->heads + j*n_components;
+	const float* mod_i  = idx->emb->mods  + i*n_components;
+	const float* mod_j  = idx->emb->mods  + j*n_components;
+
+	float dot = 0;
+	for (size_t k = 0; k < n_components; k++) {
+		dot += idx->weights2[k]*(head_i[k]*head_j[k] + mod_i[k]*mod_j[k]);
+	}
+
+	// Functions which were never seen have zero vectors.
+	// They are equally far from everything.
+	float norm = idx->norms[i]*idx->norms[j];
+	return (norm > 0) ? 1 - dot/norm : 1;
+}
+
+static inline uint32_t*
+node_links(SenseIndex* idx, size_t node, size_t level)
+{
+	if (level == 0)
+		return idx->layer0 + node*(2*idx->M+1);
+	return idx->upper_links + (idx->upper_offsets[node]+level-1)*(idx->M+1);
+}
+
+static inline size_t
+node_level(SenseIndex* idx, size_t node)
+{
+	return idx->upper_offsets[node+1] - idx->upper_offsets[node];
+}
+
+static inline size_t
+max_links(SenseIndex* idx, size_t level)
+{
+	return (level == 0) ? 2*idx->M : idx->M;
+}
+
+static int
+heap_reserve(SenseNeighbourHeap* heap, size_t cap)
+{
+	if (heap->cap >= cap)
+		return 1;
+
+	SenseNeighbour* elems = realloc(heap->elems, sizeof(SenseNeighbour)*cap);
+	if (elems == NULL)
+		return 0;
+	heap->elems = elems;
+	heap->cap   = cap;
+	return 1;
+}
+
+// The heaps keep the largest distance on the top.
+// The capacity must be reserved in advance.
+static void
+heap_push(SenseNeighbourHeap* heap, float dist, uint32_t id)
+{
+	size_t i = heap->len++;
+	while (i > 0) {
+		size_t parent = (i-1)/2;
+		if (heap->elems[parent].dist >= dist)
+			break;
+		heap->elems[i] = heap->elems[parent];
+		i = parent;
+	}
+	heap->elems[i].dist = dist;
+	heap->elems[i].id   = id;
+}
+
+static SenseNeighbour
+heap_pop(SenseNeighbourHeap* heap)
+{
+	SenseNeighbour top  = heap->elems[0];
+	SenseNeighbour last = heap->elems[--heap->len];
+
+	size_t i = 0;
+	for (;;) {
+		size_t child = 2*i+1;
+		if (child >= heap->len)
+			break;
+		if (child+1 < heap->len &&
+		    heap->elems[child+1].dist > heap->elems[child].dist)
+			child++;
+		if (last.dist >= heap->elems[child].dist)
+			break;
+		heap->elems[i] = heap->elems[child];
+		i = child;
+	}
+	heap->elems[i] = last;
+
+	return top;
+}
+
+static int
+cmp_neighbours(const void* p1, const void* p2)
+{
+	const SenseNeighbour* n1 = p1;
+	const SenseNeighbour* n2 = p2;
+	if (n1->dist < n2->dist)
+		return -1;
+	if (n1->dist > n2->dist)
+		return 1;
+	return (n1->id > n2->id) - (n1->id < n2->id);
+}
+
+static void
+new_visit(SenseIndex* idx, SenseSearch* search)
+{
+	if (++search->visit_mark == 0) {
+		memset(search->visited, 0, sizeof(uint32_t)*idx->emb->n_funs);
+		search->visit_mark = 1;
+	}
+}
+
+// Starts from the nodes in search->results and leaves there
+// the ef nodes in the given layer which are nearest to the query.
+static void
+search_layer(SenseIndex* idx, SenseSearch* search,
+             size_t query, size_t ef, size_t level)
+{
+	SenseNeighbourHeap* candidates = &search->candidates;
+	SenseNeighbourHeap* results    = &search->results;
+
+	// The candidates are ordered by negated distance
+	// in order to have the nearest one on the top.
+	new_visit(idx, search);
+	candidates->len = 0;
+	for (size_t i = 0; i < results->len; i++) {
+		search->visited[results->elems[i].id] = search->visit_mark;
+		heap_push(candidates, -results->elems[i].dist, results->elems[i].id);
+	}
+
+	while (candidates->len > 0) {
+		SenseNeighbour candidate = heap_pop(candidates);
+		if (-candidate.dist > results->elems[0].dist)
+			break;
+
+		uint32_t* links = node_links(idx, candidate.id, level);
+		for (size_t i = 1; i <= links[0]; i++) {
+			uint32_t id = links[i];
+			if (search->visited[id] == search->visit_mark)
+				continue;
+			search->visited[id] = search->visit_mark;
+
+			float dist = node_distance(idx, query, id);
+			if (results->len < ef || dist < results->elems[0].dist) {
+				heap_push(candidates, -dist, id);
+				heap_push(results, dist, id);
+				if (results->len > ef)
+					heap_pop(results);
+			}
+		}
+	}
+}
+
+// Greedy search from the entry point down to the layer above level
+static void
+descend(SenseIndex* idx, SenseSearch* search, size_t query, size_t level)
+{
+	search->results.len = 0;
+	heap_push(&search->results,
+	          node_distance(idx, query, idx->entry_point),
+	          idx->entry_point);
+	for (size_t l = idx->max_level; l > level; l--) {
+		search_layer(idx, search, query, 1, l);
+	}
+}
+
+// The candidates are sorted by their distance to the base node.
+// A candidate is kept only if it is nearer to the base than to
+// the already kept ones. This keeps links in all directions
+// rather than only in the densest one.
+static size_t
+select_neighbours(SenseIndex* idx,
+                  SenseNeighbour* candidates, size_t n_candidates,
+                  size_t m, uint32_t* selected)
+{
+	size_t n_selected = 0;
+	for (size_t i = 0; i < n_candidates && n_selected < m; i++) {
+		bool keep = true;
+		for (size_t j = 0; j < n_selected; j++) {
+			if (node_distance(idx, candidates[i].id, selected[j]) < candidates[i].dist) {
+				keep = false;
+				break;
+			}
+		}
+		if (keep)
+			selected[n_selected++] = candidates[i].id;
+	}
+	return n_selected;
+}
+
+static void
+link_node(SenseIndex* idx, size_t node, size_t neighbour, size_t level,
+          SenseNeighbour* scratch)
+{
+	uint32_t* links = node_links(idx, neighbour, level);
+	size_t max = max_links(idx, level);
+	if (links[0] < max) {
+		links[++links[0]] = node;
+		return;
+	}
+
+	// The list is full, so choose again among
+	// the old neighbours and the new one.
+	size_t n = 0;
+	scratch[n].dist = node_distance(idx, neighbour, node);
+	scratch[n].id   = node;
+	n++;
+	for (size_t i = 1; i <= links[0]; i++) {
+		scratch[n].dist = node_distance(idx, neighbour, links[i]);
+		scratch[n].id   = links[i];
+		n++;
+	}
+	qsort(scratch, n, sizeof(SenseNeighbour), cmp_neighbours);
+	links[0] = select_neighbours(idx, scratch, n, max, links+1);
+}
+
+static void
+insert_node(SenseIndex* idx, SenseSearch* search,
+            size_t node, size_t ef_construction,
+            SenseNeighbour* scratch)
+{
+	size_t level = node_level(idx, node);
+
+	descend(idx, search, node, level);
+	for (size_t l = (level < idx->max_level ? level : idx->max_level)+1; l-- > 0; ) {
+		search_layer(idx, search, node, ef_construction, l);
+
+		size_t n = search->results.len;
+		memcpy(scratch, search->results.elems, sizeof(SenseNeighbour)*n);
+		qsort(scratch, n, sizeof(SenseNeighbour), cmp_neighbours);
+
+		uint32_t* links = node_links(idx, node, l);
+		links[0] = select_neighbours(idx, scratch, n, idx->M, links+1);
+		for (size_t i = 1; i <= links[0]; i++) {
+			link_node(idx, node, links[i], l, scratch);
+		}
+	}
+
+	if (level > idx->max_level) {
+		idx->max_level   = level;
+		idx->entry_point = node;
+	}
+}
+
+static uint64_t
+index_random(uint64_t* seed)
+{
+	uint64_t x = *seed;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*seed = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void
+init_index(SenseIndex* idx, SenseEmbedding* emb)
+{
+	memset(idx, 0, sizeof(SenseIndex));
+	idx->emb = emb;
+	pthread_mutex_init(&idx->pool_lock, NULL);
+}
+
+// The norms are needed both for building and for searching
+static int
+init_norms(SenseIndex* idx)
+{
+	SenseEmbedding* emb = idx->emb;
+	size_t n_components = emb->n_components;
+
+	idx->weights2 = malloc(sizeof(float)*n_components);
+	idx->norms    = malloc(sizeof(float)*emb->n_funs);
+	if (idx->weights2 == NULL || idx->norms == NULL)
+		return 0;
+
+	for (size_t k = 0; k < n_components; k++) {
+		idx->weights2[k] = emb->weights[k]*emb->weights[k];
+	}
+
+	for (size_t i = 0; i < emb->n_funs; i++) {
+		const float* head = sense_embedding_head(emb, i);
+		const float* mod  = sense_embedding_mod(emb, i);
+		float sum = 0;
+		for (size_t k = 0; k < n_components; k++) {
+			sum += idx->weights2[k]*(head[k]*head[k] + mod[k]*mod[k]);
+		}
+		idx->norms[i] = sqrtf(sum);
+	}
+
+	return 1;
+}
+
+int
+sense_index_build(SenseIndex* idx, SenseEmbedding* emb,
+                  size_t M, size_t ef_construction, uint64_t seed)
+{
+	init_index(idx, emb);
+	idx->M = M;
+
+	size_t n_funs = emb->n_funs;
+	if (!init_norms(idx))
+		goto error;
+
+	// The levels are chosen in advance, so that the links
+	// can be allocated in the same layout as in the file.
+	idx->upper_offsets = malloc(sizeof(uint32_t)*(n_funs+1));
+	if (idx->upper_offsets == NULL)
+		goto error;
+
+	double ml = 1/log(M);
+	size_t n_upper = 0;
+	for (size_t i = 0; i < n_funs; i++) {
+		double u = ((index_random(&seed) >> 11) + 1.0) * (1.0 / 9007199254740993.0);
+		idx->upper_offsets[i] = n_upper;
+		n_upper += (size_t) (-log(u)*ml);
+	}
+	idx->upper_offsets[n_funs] = n_upper;
+
+	idx->layer0      = calloc(n_funs*(2*M+1), sizeof(uint32_t));
+	idx->upper_links = calloc(n_upper*(M+1), sizeof(uint32_t));
+	size_t scratch_size = (ef_construction > 2*M ? ef_construction : 2*M)+1;
+	SenseNeighbour* scratch = malloc(sizeof(SenseNeighbour)*scratch_size);
+	SenseSearch search;
+	if (idx->layer0 == NULL || (idx->upper_links == NULL && n_upper > 0) ||
+	    scratch == NULL || !sense_search_init(&search, idx)) {
+		free(scratch);
+		goto error;
+	}
+	if (!heap_reserve(&search.results, scratch_size)) {
+		sense_search_free(&search);
+		free(scratch);
+		goto error;
+	}
+
+	if (n_funs > 0) {
+		idx->entry_point = 0;
+		idx->max_level   = node_level(idx, 0);
+	}
+	for (size_t i = 1; i < n_funs; i++) {
+		insert_node(idx, &search, i, ef_construction, scratch);
+	}
+
+	sense_search_free(&search);
+	free(scratch);
+	return 1;
+
+error:
+	sense_index_close(idx);
+	return 0;
+}
+
+int
+sense_index_write(SenseIndex* idx, const char* fpath)
+{
+	// The services map the file, so it is replaced rather than overwritten
+	char tmp_fpath[strlen(fpath)+5];
+	sprintf(tmp_fpath, "%s.tmp", fpath);
+
+	FILE* out = fopen(tmp_fpath, "w");
+	if (out == NULL) {
+		fprintf(stderr, "Error opening %s\n", tmp_fpath);
+		return 0;
+	}
+
+	size_t n_funs  = idx->emb->n_funs;
+	size_t n_upper = idx->upper_offsets[n_funs];
+
+	SenseIndexHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic       = SENSE_INDEX_MAGIC;
+	header.M           = idx->M;
+	header.n_funs      = n_funs;
+	header.n_upper     = n_upper;
+	header.max_level   = idx->max_level;
+	header.entry_point = idx->entry_point;
+
+	size_t n_layer0 = n_funs*(2*idx->M+1);
+	size_t n_links  = n_upper*(idx->M+1);
+	bool ok = (fwrite(&header, sizeof(header), 1, out) == 1) &&
+	          (fwrite(idx->layer0, sizeof(uint32_t), n_layer0, out) == n_layer0) &&
+	          (fwrite(idx->upper_offsets, sizeof(uint32_t), n_funs+1, out) == n_funs+1) &&
+	          (fwrite(idx->upper_links, sizeof(uint32_t), n_links, out) == n_links);
+
+	if (fclose(out) != 0)
+		ok = false;
+	if (!ok || rename(tmp_fpath, fpath) != 0) {
+		fprintf(stderr, "Error writing %s\n", fpath);
+		remove(tmp_fpath);
+		return 0;
+	}
+	return 1;
+}
+
+int
+sense_index_open(SenseIndex* idx, SenseEmbedding* emb, const char* fpath)
+{
+	init_index(idx, emb);
+
+	int fd = open(fpath, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Error opening %s\n", fpath);
+		return 0;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(SenseIndexHeader)) {
+		fprintf(stderr, "%s is not a sense index\n", fpath);
+		close(fd);
+		return 0;
+	}
+
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Error reading %s\n", fpath);
+		return 0;
+	}
+
+	const SenseIndexHeader* header = data;
+	size_t n_funs = header->n_funs;
+	size_t M      = header->M;
+	size_t size = sizeof(SenseIndexHeader) +
+	              sizeof(uint32_t)*n_funs*(2*M+1) +
+	              sizeof(uint32_t)*(n_funs+1) +
+	              sizeof(uint32_t)*header->n_upper*(M+1);
+	if (header->magic != SENSE_INDEX_MAGIC || size != st.st_size) {
+		fprintf(stderr, "%s is not a sense index\n", fpath);
+		munmap(data, st.st_size);
+		return 0;
+	}
+	if (n_funs != emb->n_funs) {
+		fprintf(stderr, "%s is not built from the same embedding\n", fpath);
+		munmap(data, st.st_size);
+		return 0;
+	}
+
+	idx->data          = data;
+	idx->size          = st.st_size;
+	idx->M             = M;
+	idx->max_level     = header->max_level;
+	idx->entry_point   = header->entry_point;
+	idx->layer0        = (uint32_t*) (header+1);
+	idx->upper_offsets = idx->layer0 + n_funs*(2*M+1);
+	idx->upper_links   = idx->upper_offsets + n_funs+1;
+
+	if (!init_norms(idx)) {
+		fprintf(stderr, "Not enough memory for searching in %s\n", fpath);
+		sense_index_close(idx);
+		return 0;
+	}
+
+	return 1;
+}
+
+void
+sense_index_close(SenseIndex* idx)
+{
+	if (idx->data != NULL) {
+		munmap(idx->data, idx->size);
+	} else {
+		free(idx->layer0);
+		free(idx->upper_offsets);
+		free(idx->upper_links);
+	}
+	free(idx->weights2);
+	free(idx->norms);
+	while (idx->pool != NULL) {
+		SenseSearch* search = idx->pool;
+		idx->pool = search->next;
+		sense_search_free(search);
+		free(search);
+	}
+	pthread_mutex_destroy(&idx->pool_lock);
+	init_index(idx, idx->emb);
+}
+
+int
+sense_search_init(SenseSearch* search, SenseIndex* idx)
+{
+	memset(search, 0, sizeof(SenseSearch));
+	search->visited = calloc(idx->emb->n_funs, sizeof(uint32_t));
+	if (search->visited == NULL ||
+	    !heap_reserve(&search->candidates, idx->emb->n_funs)) {
+		sense_search_free(search);
+		return 0;
+	}
+	return 1;
+}
+
+void
+sense_search_free(SenseSearch* search)
+{
+	free(search->visited);
+	free(search->candidates.elems);
+	free(search->results.elems);
+	memset(search, 0, sizeof(SenseSearch));
+}
+
+size_t
+sense_index_search(SenseIndex* idx, SenseSearch* search, size_t query,
+                   size_t k, size_t ef, SenseNeighbour* result)
+{
+	if (idx->emb->n_funs == 0)
+		return 0;
+
+	// The query itself is always found as well
+	if (ef < k+1)
+		ef = k+1;
+	if (!heap_reserve(&search->results, ef+1))
+		return 0;
+
+	descend(idx, search, query, 0);
+	search_layer(idx, search, query, ef, 0);
+
+	size_t n = search->results.len;
+	SenseNeighbour* found = search->results.elems;
+	qsort(found, n, sizeof(SenseNeighbour), cmp_neighbours);
+	search->results.len = 0;
+
+	size_t n_result = 0;
+	for (size_t i = 0; i < n && n_result < k; i++) {
+		if (found[i].id != query)
+			result[n_result++] = found[i];
+	}
+	return n_result;
+}
+
+long
+sense_index_similar(SenseIndex* idx, const char* fun,
+                    size_t k, uint32_t* ids, float* dists)
+{
+	long query = sense_embedding_lookup(idx->emb, fun);
+	if (query < 0)
+		return -1;
+
+	pthread_mutex_lock(&idx->pool_lock);
+	SenseSearch* search = idx->pool;
+	if (search != NULL)
+		idx->pool = search->next;
+	pthread_mutex_unlock(&idx->pool_lock);
+
+	if (search == NULL) {
+		search = malloc(sizeof(SenseSearch));
+		if (search == NULL)
+			return 0;
+		if (!sense_search_init(search, idx)) {
+			free(search);
+			return 0;
+		}
+	}
+
+	size_t n = 0;
+	SenseNeighbour* result = malloc(sizeof(SenseNeighbour)*k);
+	if (result != NULL) {
+		n = sense_index_search(idx, search, query, k, 10*k, result);
+		for (size_t i = 0; i < n; i++) {
+			ids[i]   = result[i].id;
+			dists[i] = result[i].dist;
+		}
+		free(result);
+	}
+
+	pthread_mutex_lock(&idx->pool_lock);
+	search->next = idx->pool;
+	idx->pool = search;
+	pthread_mutex_unlock(&idx->pool_lock);
+
+	return n;
+}
+
+SenseIndex*
+sense_index_load(const char* emb_path, const char* index_path)
+{
+	SenseEmbedding* emb = malloc(sizeof(SenseEmbedding));
+	SenseIndex* idx = malloc(sizeof(SenseIndex));
+	if (emb == NULL || idx == NULL)
+		goto error;
+
+	if (!sense_embedding_open(emb, emb_path))
+		goto error;
+	if (!sense_index_open(idx, emb, index_path)) {
+		sense_embedding_close(emb);
+		goto error;
+	}
+
+	return idx;
+
+error:
+	free(emb);
+	free(idx);
+	return NULL;
+}
+
+const char*
+sense_index_name(SenseIndex* idx, uint32_t id)
+{
+	return sense_embedding_name(idx->emb, id);
+}
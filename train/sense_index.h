@@ -0,0 +1,129 @@
+#ifndef SENSE_INDEX_H
+#define SENSE_INDEX_H
+
+#include <pthread.h>
+#include "sense_embedding.h"
+
+// A navigable small world graph (HNSW) over the functions in
+// a sense embedding. A function is represented by its head and
+// modifier vectors, scaled by the component weights, and the distance
+// between two functions is one minus the cosine of their vectors.
+//
+// The graph is stored next to the embedding and is memory mapped
+// in the same way. After the header follow:
+//
+//   uint32_t layer0[n_funs][2*M+1]        - the number of neighbours
+//                                           and then the neighbours
+//   uint32_t upper_offsets[n_funs+1]      - node i is in the layers
+//                                           1 .. offsets[i+1]-offsets[i]
+//   uint32_t upper_links[n_upper][M+1]    - the neighbours of node i in
+//                                           layer l are in upper_offsets[i]+l-1
+
+#define SENSE_INDEX_MAGIC 0x31534e48  // "HNS1"
+
+typedef struct {
+	uint32_t magic;
+	uint32_t M;
+	uint64_t n_funs;
+	uint64_t n_upper;
+	uint32_t max_level;
+	uint32_t entry_point;
+} SenseIndexHeader;
+
+typedef struct {
+	float dist;
+	uint32_t id;
+} SenseNeighbour;
+
+typedef struct {
+	SenseNeighbour* elems;
+	size_t len;
+	size_t cap;
+} SenseNeighbourHeap;
+
+// The scratch space of one search. The index itself is not changed
+// by the searches, so any number of them can run in parallel as long
+// as each has its own SenseSearch.
+typedef struct SenseSearch SenseSearch;
+struct SenseSearch {
+	uint32_t* visited;
+	uint32_t visit_mark;
+	SenseNeighbourHeap candidates;
+	SenseNeighbourHeap results;
+	SenseSearch* next;   // in the pool of the index
+};
+
+typedef struct {
+	SenseEmbedding* emb;
+
+	void* data;      // the mapped file, NULL if the graph was built
+	size_t size;
+
+	size_t M;
+	size_t max_level;
+	size_t entry_point;
+	uint32_t* layer0;
+	uint32_t* upper_offsets;
+	uint32_t* upper_links;
+
+	float* weights2;
+	float* norms;
+
+	// The searches which are not in use by sense_index_similar.
+	// There are never more of them than parallel calls.
+	SenseSearch* pool;
+	pthread_mutex_t pool_lock;
+} SenseIndex;
+
+// Builds the graph in memory. M is the number of links per node
+// and ef_construction is the size of the candidate list while
+// inserting. Returns 0 if the memory could not be allocated.
+int
+sense_index_build(SenseIndex* idx, SenseEmbedding* emb,
+                  size_t M, size_t ef_construction, uint64_t seed);
+
+int
+sense_index_write(SenseIndex* idx, const char* fpath);
+
+// Maps a graph which sense_index_write has saved for the same
+// embedding. Returns 0 and prints a message if it cannot.
+int
+sense_index_open(SenseIndex* idx, SenseEmbedding* emb, const char* fpath);
+
+void
+sense_index_close(SenseIndex* idx);
+
+// Allocates the scratch space for searching in the index.
+// Returns 0 if the memory could not be allocated.
+int
+sense_search_init(SenseSearch* search, SenseIndex* idx);
+
+void
+sense_search_free(SenseSearch* search);
+
+// Finds up to k functions which are approximately nearest to the
+// function with the given index, not counting the function itself.
+// The larger ef is, the more accurate is the search. The neighbours
+// are stored in result sorted by distance, and their number is returned.
+size_t
+sense_index_search(SenseIndex* idx, SenseSearch* search, size_t query,
+                   size_t k, size_t ef, SenseNeighbour* result);
+
+// The same as sense_index_search but the result is split in two arrays
+// and the query is a name. Returns -1 if the function is not in
+// the embedding. The scratch space is taken from the pool of the index,
+// so the function can be called from several threads at once.
+// Meant for the bindings from SenseService.
+long
+sense_index_similar(SenseIndex* idx, const char* fun,
+                    size_t k, uint32_t* ids, float* dists);
+
+// Opens the embedding and the graph and allocates both on the heap.
+// Returns NULL if either of them cannot be opened.
+SenseIndex*
+sense_index_load(const char* emb_path, const char* index_path);
+
+const char*
+sense_index_name(SenseIndex* idx, uint32_t id);
+
+#endif
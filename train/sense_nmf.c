@@ -0,0 +1,641 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <gu/mem.h>
+#include <gu/map.h>
+#include <gu/seq.h>
+#include <gu/string.h>
+#include "sense_embedding.h"
+
+// Computes the sense embeddings from the bigram model by factorizing
+// the matrix of head-modifier probabilities X into W*M' with
+// non-negative matrices W (the head vectors) and M (the modifier
+// vectors). This is the nonnegative matrix factorization with
+// the Frobenius norm solved with the multiplicative updates:
+//
+//   W <- W .* (X*M)  ./ (W*(M'*M))
+//   M <- M .* (X'*W) ./ (M*(W'*W))
+//
+// The sparse products and the Gram matrices are computed in parallel
+// over the rows. The result is written in the format of
+// sense_embedding.h. A previous embedding can be used as the starting
+// point, in which case only the new functions start from random values.
+
+typedef struct {
+	size_t n_rows;
+	size_t* row_start;  // n_rows+1 offsets into cols and vals
+	uint32_t* cols;
+	double* vals;
+} SparseMatrix;
+
+typedef struct {
+	uint32_t row;
+	uint32_t col;
+	double val;
+} Triple;
+
+typedef struct {
+	size_t n_funs;
+	size_t n_components;
+	size_t n_threads;
+
+	SparseMatrix x, xt;
+
+	double* w;       // n_funs*n_components
+	double* m;       // n_funs*n_components
+	double* gram;    // n_components*n_components
+	double* partial; // n_threads*n_components*n_components
+	double* sums;    // n_threads
+} NMF;
+
+typedef void (*NMFKernel)(NMF* nmf, size_t start, size_t end,
+                          size_t thread_idx, void* arg);
+
+typedef struct {
+	NMF* nmf;
+	NMFKernel kernel;
+	void* arg;
+	size_t start, end;
+	size_t thread_idx;
+} NMFJob;
+
+static void*
+run_job(void* arg)
+{
+	NMFJob* job = arg;
+	job->kernel(job->nmf, job->start, job->end, job->thread_idx, job->arg);
+	return NULL;
+}
+
+// Calls the kernel for the rows 0..n_funs-1 split between the threads
+static void
+parallel_rows(NMF* nmf, NMFKernel kernel, void* arg)
+{
+	NMFJob jobs[nmf->n_threads];
+	pthread_t threads[nmf->n_threads];
+	for (size_t i = 0; i < nmf->n_threads; i++) {
+		NMFJob* job = &jobs[i];
+		job->nmf    = nmf;
+		job->kernel = kernel;
+		job->arg    = arg;
+		job->start  = (nmf->n_funs*i)/nmf->n_threads;
+		job->end    = (nmf->n_funs*(i+1))/nmf->n_threads;
+		job->thread_idx = i;
+		if (i > 0 && pthread_create(&threads[i], NULL, run_job, job) != 0) {
+			fprintf(stderr, "Creating a thread failed\n");
+			exit(1);
+		}
+	}
+
+	run_job(&jobs[0]);
+
+	for (size_t i = 1; i < nmf->n_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+static void
+gram_kernel(NMF* nmf, size_t start, size_t end, size_t thread_idx, void* arg)
+{
+	const double* a = arg;
+	size_t K = nmf->n_components;
+	double* g = nmf->partial + thread_idx*K*K;
+
+	memset(g, 0, sizeof(double)*K*K);
+	for (size_t i = start; i < end; i++) {
+		const double* row = a + i*K;
+		for (size_t k = 0; k < K; k++) {
+			if (row[k] == 0)
+				continue;
+			for (size_t l = 0; l < K; l++) {
+				g[k*K+l] += row[k]*row[l];
+			}
+		}
+	}
+}
+
+// nmf->gram = a'*a
+static void
+compute_gram(NMF* nmf, double* a)
+{
+	size_t K = nmf->n_components;
+	parallel_rows(nmf, gram_kernel, a);
+
+	memset(nmf->gram, 0, sizeof(double)*K*K);
+	for (size_t t = 0; t < nmf->n_threads; t++) {
+		const double* g = nmf->partial + t*K*K;
+		for (size_t i = 0; i < K*K; i++) {
+			nmf->gram[i] += g[i];
+		}
+	}
+}
+
+typedef struct {
+	SparseMatrix* x;
+	double* a;        // the matrix which is updated
+	const double* b;  // the other factor, nmf->gram is b'*b
+} UpdateArgs;
+
+static void
+update_kernel(NMF* nmf, size_t start, size_t end, size_t thread_idx, void* arg)
+{
+	UpdateArgs* args = arg;
+	size_t K = nmf->n_components;
+	double* num = malloc(sizeof(double)*2*K);
+	double* den = num + K;
+
+	for (size_t i = start; i < end; i++) {
+		double* row = args->a + i*K;
+
+		memset(num, 0, sizeof(double)*K);
+		for (size_t p = args->x->row_start[i]; p < args->x->row_start[i+1]; p++) {
+			const double* brow = args->b + args->x->cols[p]*K;
+			double v = args->x->vals[p];
+			for (size_t k = 0; k < K; k++) {
+				num[k] += v*brow[k];
+			}
+		}
+
+		memset(den, 0, sizeof(double)*K);
+		for (size_t l = 0; l < K; l++) {
+			if (row[l] == 0)
+				continue;
+			const double* grow = nmf->gram + l*K;
+			for (size_t k = 0; k < K; k++) {
+				den[k] += row[l]*grow[k];
+			}
+		}
+
+		for (size_t k = 0; k < K; k++) {
+			row[k] *= num[k] / (den[k] + FLT_EPSILON);
+		}
+	}
+
+	free(num);
+}
+
+static void
+cross_kernel(NMF* nmf, size_t start, size_t end, size_t thread_idx, void* arg)
+{
+	size_t K = nmf->n_components;
+	double sum = 0;
+	for (size_t i = start; i < end; i++) {
+		const double* wrow = nmf->w + i*K;
+		for (size_t p = nmf->x.row_start[i]; p < nmf->x.row_start[i+1]; p++) {
+			const double* mrow = nmf->m + nmf->x.cols[p]*K;
+			double dot = 0;
+			for (size_t k = 0; k < K; k++) {
+				dot += wrow[k]*mrow[k];
+			}
+			sum += nmf->x.vals[p]*dot;
+		}
+	}
+	nmf->sums[thread_idx] = sum;
+}
+
+// <X, W*M'>
+static double
+compute_cross(NMF* nmf)
+{
+	parallel_rows(nmf, cross_kernel, NULL);
+
+	double sum = 0;
+	for (size_t t = 0; t < nmf->n_threads; t++) {
+		sum += nmf->sums[t];
+	}
+	return sum;
+}
+
+// ||W*M'||^2 = sum((W'*W) .* (M'*M))
+static double
+compute_norm(NMF* nmf)
+{
+	size_t K = nmf->n_components;
+	double* wgram = malloc(sizeof(double)*K*K);
+	compute_gram(nmf, nmf->w);
+	memcpy(wgram, nmf->gram, sizeof(double)*K*K);
+	compute_gram(nmf, nmf->m);
+
+	double norm = 0;
+	for (size_t i = 0; i < K*K; i++) {
+		norm += wgram[i]*nmf->gram[i];
+	}
+	free(wgram);
+	return norm;
+}
+
+// ||X - W*M'||^2
+static double
+compute_loss(NMF* nmf, double x_norm)
+{
+	return x_norm - 2*compute_cross(nmf) + compute_norm(nmf);
+}
+
+static void
+build_matrix(SparseMatrix* x, size_t n_rows,
+             Triple* triples, size_t n_triples, bool transpose)
+{
+	x->n_rows    = n_rows;
+	x->row_start = calloc(n_rows+1, sizeof(size_t));
+	x->cols      = malloc(sizeof(uint32_t)*n_triples);
+	x->vals      = malloc(sizeof(double)*n_triples);
+
+	for (size_t i = 0; i < n_triples; i++) {
+		uint32_t row = transpose ? triples[i].col : triples[i].row;
+		x->row_start[row+1]++;
+	}
+	for (size_t i = 0; i < n_rows; i++) {
+		x->row_start[i+1] += x->row_start[i];
+	}
+
+	size_t* pos = malloc(sizeof(size_t)*n_rows);
+	memcpy(pos, x->row_start, sizeof(size_t)*n_rows);
+	for (size_t i = 0; i < n_triples; i++) {
+		uint32_t row = transpose ? triples[i].col : triples[i].row;
+		uint32_t col = transpose ? triples[i].row : triples[i].col;
+		size_t p = pos[row]++;
+		x->cols[p] = col;
+		x->vals[p] = triples[i].val;
+	}
+	free(pos);
+}
+
+static const char* stop_list[] = {
+	"_Prep", "_Conj", "_DConj", "_Subj", "RP",
+	"n2", "n3", "n4", "n5", "n6", "n7", "n8", "n9",
+	"D_0", "D_1", "D_2", "D_3", "D_4", "D_5", "D_6", "D_7", "D_8", "D_9",
+	"pot01", "pot41", "pot31", "_Pron",
+	"_IAdv", "_CAdv", "FullStop", "QuestMark", "ExclMark",
+	"DefArt", "IndefArt", "_Quant", "_Det", "_IDet", "_Predet",
+	"UseCopula", "_VP", "_Card", "_ACard",
+	NULL
+};
+
+static bool
+is_stop_word(const char* fun)
+{
+	size_t len = strlen(fun);
+	for (const char** s = stop_list; *s != NULL; s++) {
+		size_t slen = strlen(*s);
+		if (len >= slen && strcmp(fun+len-slen, *s) == 0)
+			return true;
+	}
+	return false;
+}
+
+static uint32_t
+intern(GuMap* ids, GuBuf* funs, const char* fun, GuPool* pool)
+{
+	uint32_t* id = gu_map_find(ids, fun);
+	if (id != NULL)
+		return *id;
+
+	GuString copy = gu_string_copy(fun, pool);
+	uint32_t new_id = gu_buf_length(funs);
+	gu_map_put(ids, copy, uint32_t, new_id);
+	gu_buf_push(funs, GuString, copy);
+	return new_id;
+}
+
+// Reads the lines "head modifier probability" and skips
+// the stop words
+static GuBuf*
+read_bigrams(const char* fpath, GuMap* ids, GuBuf* funs, GuPool* pool)
+{
+	FILE* inp = fopen(fpath, "r");
+	if (inp == NULL) {
+		fprintf(stderr, "Error opening %s\n", fpath);
+		return NULL;
+	}
+
+	GuBuf* triples = gu_new_buf(Triple, pool);
+
+	char line[4096];
+	size_t line_no = 0;
+	while (fgets(line, sizeof(line), inp)) {
+		line_no++;
+
+		char* saveptr;
+		char* head = strtok_r(line, " \t\n", &saveptr);
+		char* mod  = strtok_r(NULL, " \t\n", &saveptr);
+		char* val  = strtok_r(NULL, " \t\n", &saveptr);
+		if (head == NULL)
+			continue;
+		if (mod == NULL || val == NULL) {
+			fprintf(stderr, "%s:%zu: too few fields\n", fpath, line_no);
+			fclose(inp);
+			return NULL;
+		}
+
+		if (is_stop_word(head) || is_stop_word(mod))
+			continue;
+
+		Triple* t = gu_buf_extend(triples);
+		t->row = intern(ids, funs, head, pool);
+		t->col = intern(ids, funs, mod,  pool);
+		t->val = atof(val);
+	}
+
+	fclose(inp);
+	return triples;
+}
+
+static uint64_t
+nmf_random(uint64_t* seed)
+{
+	uint64_t x = *seed;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*seed = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void
+random_row(double* row, size_t K, double avg, uint64_t* seed)
+{
+	for (size_t k = 0; k < K; k++) {
+		row[k] = avg * 2 * (nmf_random(seed) >> 11) * (1.0 / 9007199254740992.0);
+	}
+}
+
+// Starts from a previous embedding. The weights are split evenly
+// between the head and the modifier vectors, and then the whole
+// product is scaled to fit X as well as possible.
+static int
+warm_start(NMF* nmf, GuBuf* funs, const char* fpath, bool* known)
+{
+	SenseEmbedding emb;
+	if (!sense_embedding_open(&emb, fpath))
+		return 0;
+
+	size_t K = nmf->n_components;
+	if (emb.n_components != K) {
+		fprintf(stderr, "%s has %zu components instead of %zu\n",
+		        fpath, emb.n_components, K);
+		sense_embedding_close(&emb);
+		return 0;
+	}
+
+	for (size_t i = 0; i < nmf->n_funs; i++) {
+		long index = sense_embedding_lookup(&emb, gu_buf_get(funs, GuString, i));
+		known[i] = (index >= 0);
+		for (size_t k = 0; k < K; k++) {
+			double c = sqrt(emb.weights[k]);
+			nmf->w[i*K+k] = known[i] ? sense_embedding_head(&emb, index)[k]*c : 0;
+			nmf->m[i*K+k] = known[i] ? sense_embedding_mod(&emb, index)[k]*c  : 0;
+		}
+	}
+
+	sense_embedding_close(&emb);
+
+	double norm = compute_norm(nmf);
+	if (norm > 0) {
+		double scale = sqrt(compute_cross(nmf) / norm);
+		for (size_t i = 0; i < nmf->n_funs*K; i++) {
+			nmf->w[i] *= scale;
+			nmf->m[i] *= scale;
+		}
+	}
+
+	return 1;
+}
+
+typedef struct {
+	GuString name;
+	size_t index;
+} NamedIndex;
+
+static int
+cmp_named_index(const void* p1, const void* p2)
+{
+	return strcmp(((const NamedIndex*) p1)->name, ((const NamedIndex*) p2)->name);
+}
+
+static int
+write_embedding(NMF* nmf, GuBuf* funs, const char* fpath)
+{
+	size_t K = nmf->n_components;
+	size_t n = nmf->n_funs;
+
+	// normalize the columns and collect the weights
+	double hs[K], ms[K], weights[K];
+	double total = 0;
+	for (size_t k = 0; k < K; k++) {
+		hs[k] = 0;
+		ms[k] = 0;
+		for (size_t i = 0; i < n; i++) {
+			hs[k] += nmf->w[i*K+k];
+			ms[k] += nmf->m[i*K+k];
+		}
+		weights[k] = hs[k]*ms[k];
+		total += weights[k];
+	}
+
+	NamedIndex* order = malloc(sizeof(NamedIndex)*n);
+	for (size_t i = 0; i < n; i++) {
+		order[i].name  = gu_buf_get(funs, GuString, i);
+		order[i].index = i;
+	}
+	qsort(order, n, sizeof(NamedIndex), cmp_named_index);
+
+	char tmp_fpath[strlen(fpath)+5];
+	sprintf(tmp_fpath, "%s.tmp", fpath);
+
+	FILE* out = fopen(tmp_fpath, "w");
+	if (out == NULL) {
+		fprintf(stderr, "Error opening %s\n", tmp_fpath);
+		free(order);
+		return 0;
+	}
+
+	SenseEmbeddingHeader header;
+	header.magic        = SENSE_EMBEDDING_MAGIC;
+	header.n_components = K;
+	header.n_funs       = n;
+	header.names_size   = 0;
+	for (size_t i = 0; i < n; i++) {
+		header.names_size += strlen(order[i].name)+1;
+	}
+
+	bool ok = (fwrite(&header, sizeof(header), 1, out) == 1);
+
+	uint64_t offset = 0;
+	for (size_t i = 0; i < n; i++) {
+		ok = ok && (fwrite(&offset, sizeof(offset), 1, out) == 1);
+		offset += strlen(order[i].name)+1;
+	}
+
+	float vec[K];
+	for (size_t k = 0; k < K; k++) {
+		vec[k] = (total > 0) ? weights[k] / total : 0;
+	}
+	ok = ok && (fwrite(vec, sizeof(float), K, out) == K);
+
+	for (int side = 0; side < 2; side++) {
+		const double* a    = (side == 0) ? nmf->w : nmf->m;
+		const double* sums = (side == 0) ? hs : ms;
+		for (size_t i = 0; i < n; i++) {
+			const double* row = a + order[i].index*K;
+			for (size_t k = 0; k < K; k++) {
+				vec[k] = (sums[k] > 0) ? row[k] / sums[k] : 0;
+			}
+			ok = ok && (fwrite(vec, sizeof(float), K, out) == K);
+		}
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		ok = ok && (fputs(order[i].name, out) >= 0) && (putc(0, out) == 0);
+	}
+
+	free(order);
+
+	if (fclose(out) != 0)
+		ok = false;
+	if (!ok || rename(tmp_fpath, fpath) != 0) {
+		fprintf(stderr, "Error writing %s\n", fpath);
+		remove(tmp_fpath);
+		return 0;
+	}
+	return 1;
+}
+
+static void
+usage()
+{
+	fprintf(stderr,
+	        "Syntax: sense_nmf <bigram.probs> <embedding.bin>\n"
+	        "                  [--components N] [--iterations N] [--tolerance X]\n"
+	        "                  [--threads N] [--seed N] [--init <embedding.bin>]\n");
+	exit(1);
+}
+
+int
+main(int argc, char* argv[])
+{
+	if (argc < 3)
+		usage();
+
+	size_t n_components = 100;
+	size_t max_iterations = 200;
+	double tolerance = 1e-4;
+	long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t seed = 42;
+	const char* init_fpath = NULL;
+
+	for (int i = 3; i < argc; i++) {
+		if (i+1 >= argc)
+			usage();
+
+		if (strcmp(argv[i], "--components") == 0)
+			n_components = atol(argv[++i]);
+		else if (strcmp(argv[i], "--iterations") == 0)
+			max_iterations = atol(argv[++i]);
+		else if (strcmp(argv[i], "--tolerance") == 0)
+			tolerance = atof(argv[++i]);
+		else if (strcmp(argv[i], "--threads") == 0)
+			n_threads = atol(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0)
+			seed = atol(argv[++i]);
+		else if (strcmp(argv[i], "--init") == 0)
+			init_fpath = argv[++i];
+		else
+			usage();
+	}
+	if (n_components == 0 || seed == 0)
+		usage();
+	if (n_threads < 1)
+		n_threads = 1;
+
+	GuPool* pool = gu_new_pool();
+	GuMap* ids  = gu_new_string_map(uint32_t, NULL, pool);
+	GuBuf* funs = gu_new_buf(GuString, pool);
+
+	GuBuf* triples = read_bigrams(argv[1], ids, funs, pool);
+	if (triples == NULL)
+		return 1;
+
+	NMF nmf;
+	nmf.n_funs       = gu_buf_length(funs);
+	nmf.n_components = n_components;
+	nmf.n_threads    = n_threads;
+
+	size_t n_triples = gu_buf_length(triples);
+	Triple* data = gu_buf_data(triples);
+	build_matrix(&nmf.x,  nmf.n_funs, data, n_triples, false);
+	build_matrix(&nmf.xt, nmf.n_funs, data, n_triples, true);
+
+	double x_norm = 0;
+	double x_sum  = 0;
+	for (size_t i = 0; i < n_triples; i++) {
+		x_norm += data[i].val*data[i].val;
+		x_sum  += data[i].val;
+	}
+
+	printf("(%zu, %zu) %zu non-zero\n", nmf.n_funs, nmf.n_funs, n_triples);
+
+	size_t K = n_components;
+	nmf.w       = malloc(sizeof(double)*nmf.n_funs*K);
+	nmf.m       = malloc(sizeof(double)*nmf.n_funs*K);
+	nmf.gram    = malloc(sizeof(double)*K*K);
+	nmf.partial = malloc(sizeof(double)*n_threads*K*K);
+	nmf.sums    = malloc(sizeof(double)*n_threads);
+	if (nmf.w == NULL || nmf.m == NULL || nmf.partial == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+
+	// the random values are such that the mean of W*M' is
+	// the mean of X
+	double avg = sqrt(x_sum / ((double) nmf.n_funs*nmf.n_funs) / K);
+	bool* known = calloc(nmf.n_funs, sizeof(bool));
+	if (init_fpath != NULL && !warm_start(&nmf, funs, init_fpath, known))
+		return 1;
+	for (size_t i = 0; i < nmf.n_funs; i++) {
+		if (!known[i]) {
+			random_row(nmf.w + i*K, K, avg, &seed);
+			random_row(nmf.m + i*K, K, avg, &seed);
+		}
+	}
+	free(known);
+
+	double last_loss = compute_loss(&nmf, x_norm);
+	printf("iteration 0 loss %g\n", last_loss);
+
+	UpdateArgs args;
+	for (size_t iter = 1; iter <= max_iterations; iter++) {
+		compute_gram(&nmf, nmf.m);
+		args.x = &nmf.x;
+		args.a = nmf.w;
+		args.b = nmf.m;
+		parallel_rows(&nmf, update_kernel, &args);
+
+		compute_gram(&nmf, nmf.w);
+		args.x = &nmf.xt;
+		args.a = nmf.m;
+		args.b = nmf.w;
+		parallel_rows(&nmf, update_kernel, &args);
+
+		if (iter % 10 == 0 || iter == max_iterations) {
+			double loss = compute_loss(&nmf, x_norm);
+			printf("iteration %zu loss %g\n", iter, loss);
+			fflush(stdout);
+			if (fabs(last_loss - loss) <= tolerance*fabs(last_loss))
+				break;
+			last_loss = loss;
+		}
+	}
+
+	if (!write_embedding(&nmf, funs, argv[2]))
+		return 1;
+
+	gu_pool_free(pool);
+	return 0;
+}
@@ -0,0 +1,491 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gu/mem.h>
+#include <gu/map.h>
+#include <gu/seq.h>
+#include <gu/exn.h>
+#include <gu/in.h>
+#include <gu/variant.h>
+#include "em_lexicon.h"
+
+// The examples are parsed with the GF runtime even when
+// the lexicon is read from a tab separated file.
+#ifdef EM_NO_PGF
+#error "statistics needs the GF runtime to parse the examples"
+#endif
+
+// Estimates the probabilities of the categories and the functions
+// from the abstract syntax trees in the examples:
+//
+//   probs        - for every category its share of all function
+//                  occurrences and for every function its share within
+//                  its category
+//   uncond.probs - for every function its share of all occurrences
+//
+// Every function in the grammar is counted once more for smoothing.
+// The examples are split in one shard per thread and the counts
+// are merged at the end. The output is sorted and the numbers are
+// printed like Haskell's show, so the files are the same as the ones
+// that train/statistics.hs, the reference implementation, produces.
+
+typedef struct {
+	GuMapItor clo;
+	GuMap* ids;   // PgfCId -> size_t
+	GuBuf* funs;  // PgfCId, in the order of the lexicon
+} InternItor;
+
+static void
+intern_function(GuMapItor* clo, const void* key, void* value, GuExn* err)
+{
+	InternItor* self = gu_container(clo, InternItor, clo);
+	PgfCId fun = (PgfCId) key;
+
+	gu_map_put(self->ids, fun, size_t, gu_buf_length(self->funs));
+	gu_buf_push(self->funs, PgfCId, fun);
+}
+
+typedef struct {
+	GuMap* ids;
+	const char* start;
+	const char* end;
+
+	GuPool* pool;
+	uint64_t* counts;  // indexed by the ids
+	GuMap* unknown;    // the functions which are not in the grammar
+} Shard;
+
+static void
+count_function(Shard* shard, const char* name, size_t len)
+{
+	char buf[256];
+	char* fun = (len < sizeof(buf)) ? buf : gu_malloc(shard->pool, len+1);
+	memcpy(fun, name, len);
+	fun[len] = 0;
+
+	size_t* id = gu_map_find(shard->ids, fun);
+	if (id != NULL) {
+		shard->counts[*id]++;
+		return;
+	}
+
+	uint64_t* count = gu_map_find(shard->unknown, fun);
+	if (count == NULL) {
+		count = gu_map_insert(shard->unknown, gu_string_copy(fun, shard->pool));
+		*count = 0;
+	}
+	(*count)++;
+}
+
+typedef struct Scope Scope;
+
+struct Scope {
+	PgfCId var;
+	Scope* next;
+};
+
+static bool
+is_bound(Scope* scope, PgfCId name)
+{
+	for (; scope != NULL; scope = scope->next) {
+		if (strcmp(scope->var, name) == 0)
+			return true;
+	}
+	return false;
+}
+
+// Counts the functions in the expression like exprFunctions does.
+// The variables of the lambda abstractions are not functions, so
+// the names which are bound in the scope and the wildcard are skipped.
+static void
+count_expr(Shard* shard, PgfExpr expr, Scope* scope)
+{
+	for (;;) {
+		GuVariantInfo i = gu_variant_open(expr);
+		switch (i.tag) {
+		case PGF_EXPR_ABS: {
+			PgfExprAbs* abs = i.data;
+			Scope inner = { abs->id, scope };
+			count_expr(shard, abs->body, &inner);
+			return;
+		}
+		case PGF_EXPR_APP: {
+			PgfExprApp* app = i.data;
+			count_expr(shard, app->arg, scope);
+			expr = app->fun;
+			break;
+		}
+		case PGF_EXPR_FUN: {
+			PgfExprFun* fun = i.data;
+			if (strcmp(fun->fun, "_") != 0 && !is_bound(scope, fun->fun))
+				count_function(shard, fun->fun, strlen(fun->fun));
+			return;
+		}
+		case PGF_EXPR_TYPED: {
+			PgfExprTyped* typed = i.data;
+			expr = typed->expr;
+			break;
+		}
+		case PGF_EXPR_IMPL_ARG: {
+			PgfExprImplArg* implarg = i.data;
+			expr = implarg->expr;
+			break;
+		}
+		default:
+			// literals, metavariables and variables
+			return;
+		}
+	}
+}
+
+// The lines which don't parse are skipped, like readExpr
+// returning Nothing in statistics.hs.
+static void
+count_line(Shard* shard, const char* p, const char* end)
+{
+	GuPool* tmp_pool = gu_new_pool();
+	GuExn* err = gu_new_exn(tmp_pool);
+	GuIn* in = gu_data_in((const uint8_t*) p, end-p, tmp_pool);
+	PgfExpr expr = pgf_read_expr(in, tmp_pool, tmp_pool, err);
+	if (!gu_exn_is_raised(err) && !gu_variant_is_null(expr))
+		count_expr(shard, expr, NULL);
+	gu_pool_free(tmp_pool);
+}
+
+static void*
+count_shard(void* arg)
+{
+	Shard* shard = arg;
+
+	const char* p = shard->start;
+	while (p < shard->end) {
+		const char* eol = memchr(p, '\n', shard->end-p);
+		if (eol == NULL)
+			eol = shard->end;
+
+		if (eol-p >= 4 && memcmp(p, "abs:", 4) == 0)
+			count_line(shard, p+4, eol);
+
+		p = eol+1;
+	}
+
+	return NULL;
+}
+
+// Moves p to the start of the next line unless it is already
+// at the start of a line
+static const char*
+line_start(const char* data, const char* p, const char* end)
+{
+	if (p == data || p >= end)
+		return p;
+	if (p[-1] == '\n')
+		return p;
+	const char* eol = memchr(p, '\n', end-p);
+	return (eol == NULL) ? end : eol+1;
+}
+
+// Prints the number like show does for Double in Haskell, i.e.
+// with the shortest digits that read back as the same number and
+// in scientific notation when it is below 0.1 or not below 10^7.
+static void
+print_double(FILE* out, double x)
+{
+	char buf[32];
+	for (int prec = 0; prec < 17; prec++) {
+		snprintf(buf, sizeof(buf), "%.*e", prec, x);
+		if (strtod(buf, NULL) == x)
+			break;
+	}
+
+	// buf is d.ddde[+-]xx, collect the digits
+	char digits[20];
+	size_t n_digits = 0;
+	char* p = buf;
+	for (; *p != 'e'; p++) {
+		if (*p != '.')
+			digits[n_digits++] = *p;
+	}
+	int e = atoi(p+1) + 1;  // x = 0.digits * 10^e
+	while (n_digits > 1 && digits[n_digits-1] == '0')
+		n_digits--;
+	digits[n_digits] = 0;
+
+	if (x == 0) {
+		fputs("0.0", out);
+	} else if (e < 0 || e > 7) {
+		fprintf(out, "%c.%se%d", digits[0],
+		        n_digits > 1 ? digits+1 : "0", e-1);
+	} else if (e == 0) {
+		fprintf(out, "0.%s", digits);
+	} else {
+		for (int i = 0; i < e; i++)
+			putc(i < n_digits ? digits[i] : '0', out);
+		fprintf(out, ".%s", n_digits > e ? digits+e : "0");
+	}
+}
+
+typedef struct {
+	GuString name;
+	double prob;
+} ProbEntry;
+
+static int
+cmp_prob_entry(const void* p1, const void* p2)
+{
+	return strcmp(((const ProbEntry*) p1)->name, ((const ProbEntry*) p2)->name);
+}
+
+static int
+write_probs(GuString fpath, GuBuf* entries)
+{
+	ProbEntry* data = gu_buf_data(entries);
+	size_t n_entries = gu_buf_length(entries);
+	qsort(data, n_entries, sizeof(ProbEntry), cmp_prob_entry);
+
+	FILE* out = fopen(fpath, "w");
+	if (out == NULL) {
+		fprintf(stderr, "Error opening %s\n", fpath);
+		return 0;
+	}
+
+	for (size_t i = 0; i < n_entries; i++) {
+		fprintf(out, "%s\t", data[i].name);
+		print_double(out, data[i].prob);
+		putc('\n', out);
+	}
+
+	if (fclose(out) != 0) {
+		fprintf(stderr, "Error writing %s\n", fpath);
+		return 0;
+	}
+	return 1;
+}
+
+typedef struct {
+	GuMapItor clo;
+	GuMap* counts;
+} MergeItor;
+
+static void
+merge_unknown(GuMapItor* clo, const void* key, void* value, GuExn* err)
+{
+	MergeItor* self = gu_container(clo, MergeItor, clo);
+
+	uint64_t* count = gu_map_find(self->counts, key);
+	if (count == NULL) {
+		count = gu_map_insert(self->counts, key);
+		*count = 0;
+	}
+	*count += *((uint64_t*) value);
+}
+
+typedef struct {
+	GuMapItor clo;
+	GuBuf* uncond;
+	double total;
+} UnknownItor;
+
+// The entries get the counts, which are divided by the total later
+static void
+add_unknown(GuMapItor* clo, const void* key, void* value, GuExn* err)
+{
+	UnknownItor* self = gu_container(clo, UnknownItor, clo);
+
+	ProbEntry* entry = gu_buf_extend(self->uncond);
+	entry->name = (GuString) key;
+	entry->prob = *((uint64_t*) value);
+	self->total += entry->prob;
+}
+
+typedef struct {
+	GuMapItor clo;
+	GuBuf* probs;
+	double total;
+} CategoryItor;
+
+static void
+add_category(GuMapItor* clo, const void* key, void* value, GuExn* err)
+{
+	CategoryItor* self = gu_container(clo, CategoryItor, clo);
+
+	ProbEntry* entry = gu_buf_extend(self->probs);
+	entry->name = (GuString) key;
+	entry->prob = *((double*) value) / self->total;
+}
+
+static void
+usage()
+{
+	fprintf(stderr,
+	        "Syntax: statistics <grammar.pgf or lexicon.tsv> <examples.txt>\n"
+	        "                   <probs> <uncond.probs> [--threads N]\n");
+	exit(1);
+}
+
+int
+main(int argc, char* argv[])
+{
+	if (argc < 5)
+		usage();
+
+	long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	for (int i = 5; i < argc; i++) {
+		if (strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+			n_threads = atol(argv[++i]);
+		else
+			usage();
+	}
+	if (n_threads < 1)
+		n_threads = 1;
+
+	GuPool* pool = gu_new_pool();
+	GuExn* err = gu_new_exn(pool);
+
+	EMLexicon* lex = em_open_lexicon(argv[1], pool, err);
+	if (gu_exn_is_raised(err)) {
+		fprintf(stderr, "Reading %s failed\n", argv[1]);
+		return 1;
+	}
+
+	InternItor itor;
+	itor.clo.fn = intern_function;
+	itor.ids    = gu_new_string_map(size_t, NULL, pool);
+	itor.funs   = gu_new_buf(PgfCId, pool);
+	lex->iter_functions(lex, &itor.clo, NULL);
+	size_t n_funs = gu_buf_length(itor.funs);
+
+	int fd = open(argv[2], O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "Error opening %s\n", argv[2]);
+		return 1;
+	}
+
+	const char* data = NULL;
+	if (st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "Error reading %s\n", argv[2]);
+			return 1;
+		}
+		madvise((void*) data, st.st_size, MADV_SEQUENTIAL);
+	}
+	const char* end = data + st.st_size;
+
+	// Count
+	Shard shards[n_threads];
+	pthread_t threads[n_threads];
+	for (long i = 0; i < n_threads; i++) {
+		Shard* shard = &shards[i];
+		shard->ids     = itor.ids;
+		shard->start   = line_start(data, data + (st.st_size*i)/n_threads, end);
+		shard->end     = line_start(data, data + (st.st_size*(i+1))/n_threads, end);
+		shard->pool    = gu_new_pool();
+		shard->counts  = gu_new_n(uint64_t, n_funs, shard->pool);
+		shard->unknown = gu_new_string_map(uint64_t, NULL, shard->pool);
+		memset(shard->counts, 0, sizeof(uint64_t)*n_funs);
+
+		if (pthread_create(&threads[i], NULL, count_shard, shard) != 0) {
+			fprintf(stderr, "Creating a thread failed\n");
+			return 1;
+		}
+	}
+
+	uint64_t* counts = gu_new_n(uint64_t, n_funs, pool);
+	for (size_t id = 0; id < n_funs; id++) {
+		counts[id] = 1;
+	}
+
+	MergeItor merge;
+	merge.clo.fn = merge_unknown;
+	merge.counts = gu_new_string_map(uint64_t, NULL, pool);
+
+	for (long i = 0; i < n_threads; i++) {
+		pthread_join(threads[i], NULL);
+
+		Shard* shard = &shards[i];
+		for (size_t id = 0; id < n_funs; id++) {
+			counts[id] += shard->counts[id];
+		}
+
+		// the keys stay in the pool of the shard
+		gu_map_iter(shard->unknown, &merge.clo, NULL);
+	}
+
+	if (data != NULL)
+		munmap((void*) data, st.st_size);
+	close(fd);
+
+	// Estimate. The functions which are not in the grammar
+	// only have unconditional probabilities.
+	GuBuf* probs  = gu_new_buf(ProbEntry, pool);
+	GuBuf* uncond = gu_new_buf(ProbEntry, pool);
+
+	UnknownItor unknown;
+	unknown.clo.fn = add_unknown;
+	unknown.uncond = uncond;
+	unknown.total  = 0;
+	gu_map_iter(merge.counts, &unknown.clo, NULL);
+
+	double total = unknown.total;
+	for (size_t id = 0; id < n_funs; id++) {
+		total += counts[id];
+	}
+	for (size_t i = 0; i < gu_buf_length(uncond); i++) {
+		gu_buf_index(uncond, ProbEntry, i)->prob /= total;
+	}
+
+	GuMap* cat_counts = gu_new_string_map(double, NULL, pool);
+	PgfCId* cats = gu_new_n(PgfCId, n_funs, pool);
+	for (size_t id = 0; id < n_funs; id++) {
+		PgfCId fun = gu_buf_get(itor.funs, PgfCId, id);
+
+		size_t arity;
+		cats[id] = lex->function_cat(lex, fun, &arity);
+
+		double* count = gu_map_find(cat_counts, cats[id]);
+		if (count == NULL) {
+			count = gu_map_insert(cat_counts, cats[id]);
+			*count = 0;
+		}
+		*count += counts[id];
+	}
+
+	CategoryItor cat_itor;
+	cat_itor.clo.fn = add_category;
+	cat_itor.probs  = probs;
+	cat_itor.total  = total;
+	gu_map_iter(cat_counts, &cat_itor.clo, NULL);
+
+	for (size_t id = 0; id < n_funs; id++) {
+		PgfCId fun = gu_buf_get(itor.funs, PgfCId, id);
+
+		// the category wins if a function has the same name
+		if (gu_map_find(cat_counts, fun) == NULL) {
+			ProbEntry* entry = gu_buf_extend(probs);
+			entry->name = fun;
+			entry->prob = counts[id] / gu_map_get(cat_counts, cats[id], double);
+		}
+
+		ProbEntry* entry = gu_buf_extend(uncond);
+		entry->name = fun;
+		entry->prob = counts[id] / total;
+	}
+
+	if (!write_probs(argv[3], probs) || !write_probs(argv[4], uncond))
+		return 1;
+
+	for (long i = 0; i < n_threads; i++) {
+		gu_pool_free(shards[i].pool);
+	}
+	gu_pool_free(pool);
+	return 0;
+}
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "synset_graph.h"
+
+int
+synset_graph_open(SynsetGraph* graph, const char* fpath)
+{
+	int fd = open(fpath, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Error opening %s\n", fpath);
+		return 0;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(SynsetGraphHeader)) {
+		fprintf(stderr, "%s is not a synset graph\n", fpath);
+		close(fd);
+		return 0;
+	}
+
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Error reading %s\n", fpath);
+		return 0;
+	}
+
+	const SynsetGraphHeader* header = data;
+	size_t n_synsets = header->n_synsets;
+	size_t n_lexemes = header->n_lexemes;
+	size_t size = sizeof(SynsetGraphHeader) +
+	              sizeof(uint64_t)*(n_synsets+n_lexemes) +
+	              sizeof(uint32_t)*(3*(n_synsets+1)+header->n_pointers+header->n_hypernyms) +
+	              header->n_pointers +
+	              header->glosses_size +
+	              header->funs_size;
+	if (header->magic != SYNSET_GRAPH_MAGIC || size != st.st_size) {
+		fprintf(stderr, "%s is not a synset graph\n", fpath);
+		munmap(data, st.st_size);
+		return 0;
+	}
+
+	graph->data = data;
+	graph->size = st.st_size;
+	graph->n_synsets     = n_synsets;
+	graph->n_lexemes     = n_lexemes;
+	graph->gloss_offsets = (const uint64_t*) (header+1);
+	graph->fun_offsets   = graph->gloss_offsets + n_synsets;
+	graph->ptr_offsets   = (const uint32_t*) (graph->fun_offsets + n_lexemes);
+	graph->ptr_targets   = graph->ptr_offsets + n_synsets+1;
+	graph->hyp_offsets   = graph->ptr_targets + header->n_pointers;
+	graph->hyp_targets   = graph->hyp_offsets + n_synsets+1;
+	graph->lex_offsets   = graph->hyp_targets + header->n_hypernyms;
+	graph->ptr_tags      = (const uint8_t*) (graph->lex_offsets + n_synsets+1);
+	graph->glosses       = (const char*) (graph->ptr_tags + header->n_pointers);
+	graph->funs          = graph->glosses + header->glosses_size;
+
+	// The rows are read without checks later, so at least
+	// the ends of the rows must agree with the header.
+	if (graph->ptr_offsets[n_synsets] != header->n_pointers ||
+	    graph->hyp_offsets[n_synsets] != header->n_hypernyms ||
+	    graph->lex_offsets[n_synsets] != n_lexemes) {
+		fprintf(stderr, "%s is not a synset graph\n", fpath);
+		synset_graph_close(graph);
+		return 0;
+	}
+
+	return 1;
+}
+
+void
+synset_graph_close(SynsetGraph* graph)
+{
+	munmap(graph->data, graph->size);
+	graph->data = NULL;
+}
+
+SynsetGraph*
+synset_graph_load(const char* fpath)
+{
+	SynsetGraph* graph = malloc(sizeof(SynsetGraph));
+	if (graph == NULL)
+		return NULL;
+
+	if (!synset_graph_open(graph, fpath)) {
+		free(graph);
+		return NULL;
+	}
+
+	return graph;
+}
+
+const char*
+synset_graph_gloss(SynsetGraph* graph, size_t synset)
+{
+	if (synset >= graph->n_synsets)
+		return "";
+	return graph->glosses + graph->gloss_offsets[synset];
+}
+
+size_t
+synset_graph_pointers(SynsetGraph* graph, size_t synset,
+                      const uint8_t** tags, const uint32_t** targets)
+{
+	if (synset >= graph->n_synsets)
+		return 0;
+
+	size_t start = graph->ptr_offsets[synset];
+	*tags    = graph->ptr_tags + start;
+	*targets = graph->ptr_targets + start;
+	return graph->ptr_offsets[synset+1] - start;
+}
+
+size_t
+synset_graph_hypernyms(SynsetGraph* graph, size_t synset,
+                       const uint32_t** targets)
+{
+	if (synset >= graph->n_synsets)
+		return 0;
+
+	size_t start = graph->hyp_offsets[synset];
+	*targets = graph->hyp_targets + start;
+	return graph->hyp_offsets[synset+1] - start;
+}
+
+size_t
+synset_graph_lexemes(SynsetGraph* graph, size_t synset, size_t* first)
+{
+	if (synset >= graph->n_synsets)
+		return 0;
+
+	*first = graph->lex_offsets[synset];
+	return graph->lex_offsets[synset+1] - *first;
+}
+
+const char*
+synset_graph_fun(SynsetGraph* graph, size_t lexeme)
+{
+	return graph->funs + graph->fun_offsets[lexeme];
+}
@@ -0,0 +1,95 @@
+#ifndef SYNSET_GRAPH_H
+#define SYNSET_GRAPH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The synsets with their pointers and lexemes, which build/glosses
+// writes next to semantics.db as semantics.graph. The rows are indexed
+// by the synset key, and the pointers of synset k are at positions
+// ptr_offsets[k] .. ptr_offsets[k+1]-1 in ptr_targets and ptr_tags.
+// The same holds for the hypernyms and the lexemes. The hypernyms are
+// also kept in rows of their own, since the synsets high in the
+// hierarchy have thousands of hyponym pointers to skip otherwise.
+//
+// It is meant to be memory mapped, so everything is in native byte
+// order and aligned. After the header follow:
+//
+//   uint64_t gloss_offsets[n_synsets] - the offsets of the glosses
+//   uint64_t fun_offsets[n_lexemes]   - the offsets of the functions
+//   uint32_t ptr_offsets[n_synsets+1]
+//   uint32_t ptr_targets[n_pointers]
+//   uint32_t hyp_offsets[n_synsets+1]
+//   uint32_t hyp_targets[n_hypernyms]
+//   uint32_t lex_offsets[n_synsets+1]
+//   uint8_t  ptr_tags[n_pointers]      - see pointerSymbols in SenseSchema
+//   char     glosses[glosses_size]     - UTF-8, NUL terminated
+//   char     funs[funs_size]           - UTF-8, NUL terminated
+
+#define SYNSET_GRAPH_MAGIC 0x31475953  // "SYG1"
+
+typedef struct {
+	uint32_t magic;
+	uint32_t n_synsets;
+	uint64_t n_pointers;
+	uint64_t n_hypernyms;
+	uint64_t n_lexemes;
+	uint64_t glosses_size;
+	uint64_t funs_size;
+} SynsetGraphHeader;
+
+typedef struct {
+	void* data;
+	size_t size;
+
+	size_t n_synsets;
+	size_t n_lexemes;
+	const uint64_t* gloss_offsets;
+	const uint64_t* fun_offsets;
+	const uint32_t* ptr_offsets;
+	const uint32_t* ptr_targets;
+	const uint32_t* hyp_offsets;
+	const uint32_t* hyp_targets;
+	const uint32_t* lex_offsets;
+	const uint8_t* ptr_tags;
+	const char* glosses;
+	const char* funs;
+} SynsetGraph;
+
+// Maps the file into memory. Returns 0 and prints a message
+// if the file cannot be read or is not a synset graph.
+int
+synset_graph_open(SynsetGraph* graph, const char* fpath);
+
+void
+synset_graph_close(SynsetGraph* graph);
+
+// The same as synset_graph_open but the graph is allocated
+// on the heap. Returns NULL if it cannot be opened.
+// Meant for the bindings from SenseService.
+SynsetGraph*
+synset_graph_load(const char* fpath);
+
+// The gloss of the synset, or "" if there is no such synset
+const char*
+synset_graph_gloss(SynsetGraph* graph, size_t synset);
+
+// Returns the number of pointers from the synset and stores
+// in tags and targets the start of their rows.
+size_t
+synset_graph_pointers(SynsetGraph* graph, size_t synset,
+                      const uint8_t** tags, const uint32_t** targets);
+
+size_t
+synset_graph_hypernyms(SynsetGraph* graph, size_t synset,
+                       const uint32_t** targets);
+
+// Returns the number of lexemes in the synset. Their indices
+// for synset_graph_fun start from the one stored in first.
+size_t
+synset_graph_lexemes(SynsetGraph* graph, size_t synset, size_t* first);
+
+const char*
+synset_graph_fun(SynsetGraph* graph, size_t lexeme);
+
+#endif
@@ -6,6 +6,9 @@ import Control.Exception
 import System.IO
 import System.Environment
 import System.FilePath
+import System.Directory
+import Control.Concurrent(threadDelay)
+import Control.Monad(unless)
 import Data.Time.Clock
 
 main = do
@@ -15,23 +18,92 @@ main = do
                        withEMState gr 1 0.002 $ \st ->
                          case args of
                            "train":args      -> training st "Parse.labels" args
+                           "worker":dir:n:args
+                                             -> worker st "Parse.labels" dir (read n :: Int) args
+                           "coordinate":dir:n:_
+                                             -> coordinator st dir (read n :: Int)
                            "annotate":lang:_ -> annotation st (replaceExtension fpath "bigram.probs") lang
                            _                 -> help
     _            -> help
 
 help = do
-  putStrLn "Syntax: udsenser <grammar> train"
+  putStrLn "Syntax: udsenser <grammar> train <lang> <files> , <lang> <files> ..."
+  putStrLn "        udsenser <grammar> worker <dir> <worker no> <lang> <files> , ..."
+  putStrLn "        udsenser <grammar> coordinate <dir> <number of workers>"
   putStrLn "        udsenser <grammar> annotate <concr syntax>"
 
 training st labels_fpath args = do
+  loading st labels_fpath args
+  status "Estimation ..." $ em_loop st 0 0
+  status "Dumping ..." $ dump st "Parse.probs" "Parse.bigram.probs"
+--  exportAbstractTreebank st "trees.txt"
+
+-- Distributed training. The workers and the coordinator communicate
+-- through files in a shared directory. In iteration i every worker
+-- writes counts.<i>.<worker no>, the coordinator merges them into
+-- probs.<i>, and the workers run the next estimation with them.
+worker st labels_fpath dir n args = do
+  loading st labels_fpath args
+  status "Estimation ..." $ loop 0
+  where
+    loop i = do
+      writeCounts st (dir </> ("counts."++show i++"."++show n))
+      let probs_fpath = dir </> ("probs."++show i)
+      waitForFile probs_fpath
+      finished <- readProbs st probs_fpath
+      unless finished $ do
+        estimate st
+        loop (i+1)
+
+coordinator st dir n = do
+  status "Estimation ..." $ loop 0 0
+  status "Dumping ..." $ dump st "Parse.probs" "Parse.bigram.probs"
+  where
+    loop i last_corpus_prob = do
+      let counts_fpaths = [dir </> ("counts."++show i++"."++show k) | k <- [0..n-1]]
+      mapM_ waitForFile counts_fpaths
+      corpus_prob <- mergeCounts st counts_fpaths
+      -- the first counts come from the import and not from an estimation
+      let finished = i > 1 && abs (last_corpus_prob - corpus_prob) < 1e-4
+      writeProbs st (dir </> ("probs."++show i)) finished
+      mapM_ removeFile counts_fpaths
+      -- all workers have read the previous probabilities
+      -- if they managed to write new counts
+      unless (i == 0) $
+        removeFile (dir </> ("probs."++show (i-1)))
+      unless (i == 0) $ do
+        hPutStr stdout ("\n"++show (i-1)++" "++show corpus_prob++" ("++show (last_corpus_prob-corpus_prob)++")")
+        hFlush stdout
+      unless finished $
+        loop (i+1) corpus_prob
+
+-- The memory used for the trees can be limited with the environment
+-- variables EM_REGION_SIZE, EM_MAX_ELEM_SIZE and EM_MAX_RESIDENT.
+-- All sizes are in bytes.
+setupDataStream st = do
+  region_size   <- getSize "EM_REGION_SIZE"   (64*1024*1024)
+  max_elem_size <- getSize "EM_MAX_ELEM_SIZE" (16*1024)
+  max_resident  <- getSize "EM_MAX_RESIDENT"  0
+  configureDataStream st region_size max_elem_size max_resident
+  where
+    getSize name def = fmap (maybe def read) (lookupEnv name)
+
+waitForFile fpath = do
+  exists <- doesFileExist fpath
+  unless exists $ do
+    threadDelay 100000
+    waitForFile fpath
+
+-- The trees are only used for training, so they can be compacted
+-- and deduplicated
+loading st labels_fpath args = do
+  setupDataStream st
+  setImportOptions st [CompactTrees, DeduplicateTrees]
   status "Setup ranking ..." $ setupRankingCallbacks st default_ranking_callbacks
   config <- readDepConfig labels_fpath
   importTreebanks config args
   getBigramCount  st >>= \c -> hPutStrLn stdout ("Bigrams:  "++show c)
   getUnigramCount st >>= \c -> hPutStrLn stdout ("Unigrams: "++show c)
-  status "Estimation ..." $ em_loop st 0 0
-  status "Dumping ..." $ dump st "Parse.probs" "Parse.bigram.probs"
---  exportAbstractTreebank st "trees.txt"
   where
     importTreebanks config []          = return ()
     importTreebanks config (lang:args) = do
@@ -49,14 +121,15 @@ training st labels_fpath args = do
 
     importExamples config st fpath = do
       ls <- fmap lines $ readFile fpath
-      sequence_ [addDepTree st dtree >> incrementCounts st e
-                      | l <- ls,
-                        take 4 l == "abs:",
-                        Just e <- [readExpr (drop 4 l)],
-                        dtree <- expr2DepForest config e
-                      ]
+      addDepTrees st [(dtree,e)
+                        | l <- ls,
+                          take 4 l == "abs:",
+                          Just e <- [readExpr (drop 4 l)],
+                          dtree <- expr2DepForest config e
+                     ]
 
 annotation st bigram_fpath lang = do
+  setupDataStream st
   status "Setup ranking ..." $ setupRankingCallbacks st default_ranking_callbacks
   status "Load model ..." $ loadModel st bigram_fpath
   status "Import data ..." $ do
@@ -74,6 +147,7 @@ em_loop st i last_corpus_prob = do
   t1 <- getCurrentTime
   corpus_prob <- step st
   t2 <- getCurrentTime
+  dumpStats st "em_stats.jsonl" i
   let t = diffUTCTime t2 t1
   hPutStr stdout ("\n"++show i++" "++show corpus_prob++" ("++show (last_corpus_prob-corpus_prob)++") "++show t)
   hFlush stdout
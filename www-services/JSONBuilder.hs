@@ -0,0 +1,52 @@
+module JSONBuilder(jsonBuilder, encodeJSON) where
+
+import Text.JSON
+import Data.Char(ord)
+import Data.List(intersperse)
+import Data.Monoid((<>))
+import Data.Ratio(numerator,denominator)
+import Numeric(showHex)
+import qualified Data.ByteString as BS
+import qualified Data.ByteString.Lazy as BSL
+import qualified Data.ByteString.Builder as BB
+
+-- | Writes the same text as Text.JSON.encode, but directly
+-- as UTF-8 bytes instead of as a String.
+jsonBuilder :: JSValue -> BB.Builder
+jsonBuilder JSNull              = BB.string7 "null"
+jsonBuilder (JSBool True)       = BB.string7 "true"
+jsonBuilder (JSBool False)      = BB.string7 "false"
+jsonBuilder (JSRational f r)    = rational f r
+jsonBuilder (JSString s)        = string (fromJSString s)
+jsonBuilder (JSArray vs)        = BB.char7 '[' <> commaSep (map jsonBuilder vs) <> BB.char7 ']'
+jsonBuilder (JSObject o)        = BB.char7 '{' <> commaSep (map field (fromJSObject o)) <> BB.char7 '}'
+  where
+    field (k,v) = string k <> BB.char7 ':' <> jsonBuilder v
+
+encodeJSON :: JSON a => a -> BS.ByteString
+encodeJSON = BSL.toStrict . BB.toLazyByteString . jsonBuilder . showJSON
+
+commaSep = mconcat . intersperse (BB.char7 ',')
+
+rational asFloat r
+  | denominator r == 1      = BB.integerDec (numerator r)
+  | isInfinite x || isNaN x = BB.string7 "null"
+  | asFloat                 = BB.string7 (show (realToFrac r :: Float))
+  | otherwise               = BB.string7 (show x)
+  where
+    x = realToFrac r :: Double
+
+string s = BB.char7 '"' <> foldr (\c b -> char c <> b) (BB.char7 '"') s
+  where
+    char '"'  = BB.string7 "\\\""
+    char '\\' = BB.string7 "\\\\"
+    char '\b' = BB.string7 "\\b"
+    char '\f' = BB.string7 "\\f"
+    char '\n' = BB.string7 "\\n"
+    char '\r' = BB.string7 "\\r"
+    char '\t' = BB.string7 "\\t"
+    char c
+      | c < '\x20' = BB.string7 "\\u00" <> BB.string7 (pad (showHex (ord c) ""))
+      | otherwise  = BB.charUtf8 c
+
+    pad h = replicate (2 - length h) '0' ++ h
@@ -1,12 +1,15 @@
 {-# LANGUAGE MonadComprehensions #-}
-module PatternMatching(matchPattern,Variable,Triple,Pattern(..),Binding(..)) where
+module PatternMatching(matchPattern,planPattern,Variable,Triple,Pattern(..),Binding(..)) where
 
 import Database.Daison
 import PGF2
 import SenseSchema
 import qualified Data.Map.Strict as Map
+import qualified Data.Set as Set
 import Data.Char
-import Data.Maybe (maybe)
+import Data.List (minimumBy,delete,nub)
+import Data.Maybe (maybe,fromMaybe)
+import Data.Ord (comparing)
 import Control.Monad
 import Text.JSON
 
@@ -29,10 +32,67 @@ instance JSON Pattern where
     return (Pattern triples env)
   readJSON _ = fail "JSON object expected"
     
-matchPattern (Pattern ts values) = do
-  env <- initEnv values
-  matchTriples ts env
+-- | Puts the triples in the order in which they are cheapest to match.
+-- Every time, the triple with the lowest estimated cost per binding
+-- is chosen, given the variables bound so far. A triple with a bound
+-- variable follows the pointers from that side, using the inverse
+-- pointer if it is the object which is bound. Only a triple with no
+-- bound variables needs a scan over all lexemes. The result is also
+-- the estimated number of rows visited by the whole pattern.
+planPattern :: CorpusStatistics -> Pattern -> (Double,Pattern)
+planPattern stats (Pattern ts values) =
+  let (cost,ts') = plan 1 0 (Set.fromList (map fst values ++ literals ts)) ts
+  in (cost,Pattern ts' values)
   where
+    plan rows cost bound [] = (cost,[])
+    plan rows cost bound ts =
+      let ((c,m),t@(x,_,y)) = minimumBy (comparing fst) [(estimate bound t,t) | t <- ts]
+          (cost',ts')       = plan (rows*m) (cost+rows*c)
+                                   (Set.insert x (Set.insert y bound))
+                                   (delete t ts)
+      in (cost',t:ts')
+
+    -- the rows visited and the bindings produced for every binding so far
+    estimate bound (x,p,y)
+      | bx && by                       = (fanout p, min 1 (fanout p))
+      | bx                             = (fanout p, fanout p)
+      | by, Just q <- inversePointer p = (fanout q, fanout q)
+      | by                             = (scan, fanout p)
+      | otherwise                      = (scan, edges p)
+      where
+        bx = Set.member x bound
+        by = Set.member y bound
+
+    counts p = fromMaybe (0,0) (lookup p (stat_pointers stats))
+
+    edges p = let (l,s) = counts p in fromIntegral (l+s)
+
+    fanout p = let (l,s) = counts p
+               in fromIntegral l / fromIntegral (max 1 (stat_lexemes stats)) +
+                  fromIntegral s / fromIntegral (max 1 (stat_synsets stats))
+
+    scan = fromIntegral (stat_lexemes stats)
+
+-- | The variables which are synset keys written as numbers
+literals ts = nub [v | (x,_,y) <- ts, v <- [x,y], not (null v), all isDigit v]
+
+-- | Finds at most n matches. Every triple is a separate query for each
+-- binding of the triples before it, so the search stops as soon as
+-- there are n matches instead of enumerating all of them first.
+matchPattern :: Int -> Pattern -> Daison [Env]
+matchPattern n (Pattern ts values) = do
+  envs <- select (initEnv values >>= bindLiterals)
+  firstMatches n ts envs
+  where
+    bindLiterals env = foldM (\env v -> bindSynset v (read v) env) env (literals ts)
+
+    firstMatches n ts []         = return []
+    firstMatches n ts (env:envs)
+      | n <= 0    = return []
+      | otherwise = do matches <- matchTriples n ts env
+                       rest    <- firstMatches (n - length matches) ts envs
+                       return (matches ++ rest)
+
     initEnv []                     = return Map.empty
     initEnv ((var,lex_fun):values) = do
       res <- select [LexemeValue key lexeme mb_synset
@@ -46,32 +106,23 @@ matchPattern (Pattern ts values) = do
         (value:_) -> do env <- initEnv values
                         return (Map.insert var value env)
 
-    matchTriples []           env = return env
-    matchTriples ((x,p,y):ts) env = do
-      env <- matchTriple x p y (maybe (fullScan x p y) (\p -> matchTriple y p x (fullScan x p y)) (inversePointer p)) env
-      matchTriples ts env
-
-    matchTriple x p y cont env
-      | all isDigit x = do
-            let key = read x
-            synset <- from synsets (at key)
-            (followSynsetPtr synset p y env
-             `mplus`
-             do lexemes <- select (fromIndex lexemes_synset (at key))
-                (id,lexeme) <- anyOf lexemes
-                followLexemePtr lexeme p y env)
-      | otherwise     =
-           case Map.lookup x env of
-             Just (LexemeValue _ lexeme mb_syn)  -> followLexemePtr lexeme p y env
-                                                    `mplus`
-                                                    case mb_syn of
-                                                      Just synset -> followSynsetPtr synset p y env
-                                                      Nothing     -> mzero
-             Just (SynsetValue _ synset lexemes) -> followSynsetPtr synset p y env
-                                                    `mplus`
-                                                    do (id,lexeme) <- anyOf lexemes
-                                                       followLexemePtr lexeme p y env
-             Nothing                             -> cont env
+    matchTriples n []           env = return [env]
+    matchTriples n ((x,p,y):ts) env = do
+      envs <- select (matchTriple x p y (maybe (fullScan x p y) (\p -> matchTriple y p x (fullScan x p y)) (inversePointer p)) env)
+      firstMatches n ts envs
+
+    matchTriple x p y cont env =
+      case Map.lookup x env of
+        Just (LexemeValue _ lexeme mb_syn)  -> followLexemePtr lexeme p y env
+                                               `mplus`
+                                               case mb_syn of
+                                                 Just synset -> followSynsetPtr synset p y env
+                                                 Nothing     -> mzero
+        Just (SynsetValue _ synset lexemes) -> followSynsetPtr synset p y env
+                                               `mplus`
+                                               do (id,lexeme) <- anyOf lexemes
+                                                  followLexemePtr lexeme p y env
+        Nothing                             -> cont env
 
     fullScan x p y env = do
       (key,lexeme) <- from lexemes everything
@@ -0,0 +1,97 @@
+{-# LANGUAGE BangPatterns #-}
+module ResponseCache(ResponseCache, newResponseCache,
+                     databaseVersion, cachedResponse, responseETag) where
+
+import Control.Concurrent.MVar
+import System.Directory(getModificationTime)
+import Data.Bits(xor)
+import Data.Char(ord)
+import Data.Word
+import Numeric(showHex)
+import qualified Data.Map.Strict as Map
+import qualified Data.ByteString as BS
+
+-- | The JSON of recent queries, least recently used first out.
+-- The entries belong to one version of the database and are
+-- dropped as soon as the database file changes.
+data ResponseCache = ResponseCache FilePath Int (MVar Entries)
+
+data Entries
+  = Entries
+      { version :: String
+      , clock   :: !Int
+      , size    :: !Int
+      , values  :: Map.Map String (Int,BS.ByteString)
+      , lru     :: Map.Map Int String
+      }
+
+emptyEntries version = Entries version 0 0 Map.empty Map.empty
+
+-- | The capacity is the total size of the responses in bytes
+newResponseCache :: FilePath -> Int -> IO ResponseCache
+newResponseCache fpath capacity =
+  fmap (ResponseCache fpath capacity) (newMVar (emptyEntries ""))
+
+-- | Changes every time the database is rebuilt
+databaseVersion :: ResponseCache -> IO String
+databaseVersion (ResponseCache fpath _ _) =
+  fmap show (getModificationTime fpath)
+
+-- | Returns the cached response or computes and caches it.
+-- The computation runs outside of the lock, and if it returns
+-- Nothing, nothing is cached.
+cachedResponse :: ResponseCache -> String -> String -> IO (Maybe BS.ByteString) -> IO (Maybe BS.ByteString)
+cachedResponse (ResponseCache _ capacity ref) ver key compute = do
+  mb_value <- modifyMVar ref $ \entries0 -> do
+    let entries | version entries0 == ver = entries0
+                | otherwise               = emptyEntries ver
+    case Map.lookup key (values entries) of
+      Just (t,value) -> return (touch t value entries, Just value)
+      Nothing        -> return (entries, Nothing)
+  case mb_value of
+    Just value -> return (Just value)
+    Nothing    -> do mb_value <- compute
+                     case mb_value of
+                       Just value -> modifyMVar_ ref (return . insert value)
+                       Nothing    -> return ()
+                     return mb_value
+  where
+    touch t value entries =
+      let t' = clock entries
+      in entries{clock=t'+1
+                ,values=Map.insert key (t',value) (values entries)
+                ,lru=Map.insert t' key (Map.delete t (lru entries))
+                }
+
+    insert value entries
+      | version entries /= ver          = entries
+      | Map.member key (values entries) = entries
+      | BS.length value > capacity      = entries
+      | otherwise                       =
+          let t = clock entries
+          in evict entries{clock=t+1
+                          ,size=size entries+BS.length value
+                          ,values=Map.insert key (t,value) (values entries)
+                          ,lru=Map.insert t key (lru entries)
+                          }
+
+    evict entries
+      | size entries <= capacity = entries
+      | otherwise                =
+          let ((_,key'),lru') = Map.deleteFindMin (lru entries)
+              value_size      = maybe 0 (BS.length . snd) (Map.lookup key' (values entries))
+          in evict entries{size=size entries-value_size
+                          ,values=Map.delete key' (values entries)
+                          ,lru=lru'
+                          }
+
+-- | A tag which is the same as long as the database and
+-- the request are the same
+responseETag :: String -> String -> String
+responseETag ver key = "\"" ++ showHex (fnv1a (ver ++ "\0" ++ key)) "" ++ "\""
+  where
+    fnv1a :: String -> Word64
+    fnv1a = go 14695981039346656037
+      where
+        go !h []     = h
+        go !h (c:cs) = go ((h `xor` fromIntegral (ord c)) * 1099511628211) cs
@@ -0,0 +1,48 @@
+{-# LANGUAGE ForeignFunctionInterface #-}
+module SenseIndex(SenseIndex, openSenseIndex, similarLexemes) where
+
+import Foreign
+import Foreign.C
+import qualified GHC.Foreign as GHC
+import GHC.IO.Encoding(utf8)
+
+-- | The similarity index built by sense_hnsw over
+-- the embedding from sense_nmf. The mapped files are only read,
+-- and every search takes its own scratch space on the C side,
+-- so the requests can search in parallel.
+newtype SenseIndex = SenseIndex (Ptr ())
+
+-- | Opens the embedding and its index. Returns Nothing if
+-- either of them is missing or they don't belong together.
+openSenseIndex :: FilePath -> FilePath -> IO (Maybe SenseIndex)
+openSenseIndex emb_path index_path =
+  withCString emb_path $ \c_emb_path ->
+  withCString index_path $ \c_index_path -> do
+    ptr <- sense_index_load c_emb_path c_index_path
+    if ptr == nullPtr
+      then return Nothing
+      else return (Just (SenseIndex ptr))
+
+-- | The k lexemes which are the most similar to the given one,
+-- together with their cosine distances.
+similarLexemes :: SenseIndex -> String -> Int -> IO [(String,Double)]
+similarLexemes _                lex_id k
+  | k <= 0    = return []
+similarLexemes (SenseIndex ptr) lex_id k =
+  GHC.withCString utf8 lex_id $ \c_lex_id ->
+  allocaArray k $ \c_ids ->
+  allocaArray k $ \c_dists -> do
+    n <- sense_index_similar ptr c_lex_id (fromIntegral k) c_ids c_dists
+    ids   <- peekArray (max 0 (fromIntegral n)) c_ids
+    dists <- peekArray (max 0 (fromIntegral n)) c_dists
+    names <- mapM (\id -> sense_index_name ptr id >>= GHC.peekCString utf8) ids
+    return (zip names (map realToFrac dists))
+
+foreign import ccall "sense_index.h sense_index_load"
+  sense_index_load :: CString -> CString -> IO (Ptr ())
+
+foreign import ccall "sense_index.h sense_index_similar"
+  sense_index_similar :: Ptr () -> CString -> CSize -> Ptr Word32 -> Ptr CFloat -> IO CLong
+
+foreign import ccall "sense_index.h sense_index_name"
+  sense_index_name :: Ptr () -> Word32 -> IO CString
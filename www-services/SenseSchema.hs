@@ -5,7 +5,9 @@ module SenseSchema where
 import PGF2
 import Database.Daison
 import Data.Data
-import Data.List(nub)
+import Data.List(nub,elemIndex)
+import Data.Maybe(fromMaybe)
+import Data.Word(Word8)
 import Interval
 
 type SynsetOffset = String
@@ -14,13 +16,13 @@ data DomainType
   = Topic
   | Region
   | Usage
-  deriving (Data,Eq,Show,Read)
+  deriving (Data,Eq,Ord,Show,Read)
 
 data HolonymyType
   = Member
   | Substance
   | Part
-  deriving (Data,Eq,Show,Read)
+  deriving (Data,Eq,Ord,Show,Read)
 
 data PointerSymbol
   = Antonym
@@ -40,7 +42,7 @@ data PointerSymbol
   | SimilarTo
   | Derived
   | Participle
-  deriving (Data,Eq,Show,Read)
+  deriving (Data,Eq,Ord,Show,Read)
 
 inversePointer Antonym             = Just Antonym
 inversePointer Hypernym            = Just Hyponym
@@ -57,6 +59,20 @@ inversePointer SimilarTo           = Just SimilarTo
 inversePointer Derived             = Just Derived
 inversePointer _                   = Nothing
 
+-- | The pointer symbols in the order of their one-byte
+-- tags in semantics.graph, see train/synset_graph.h
+pointerSymbols :: [PointerSymbol]
+pointerSymbols =
+  [Antonym,Hypernym,InstanceHypernym,Hyponym,InstanceHyponym] ++
+  [c t | c <- [Holonym,Meronym], t <- [Member,Substance,Part]] ++
+  [c t | c <- [DomainOfSynset,MemberOfDomain], t <- [Topic,Region,Usage]] ++
+  [Attribute,Entailment,Cause,AlsoSee,VerbGroup,SimilarTo,Derived,Participle]
+
+pointerTag :: PointerSymbol -> Word8
+pointerTag sym =
+  fromIntegral (fromMaybe (error ("Unknown pointer "++show sym))
+                          (elemIndex sym pointerSymbols))
+
 data Synset
   = Synset
       { synsetOffset :: SynsetOffset
@@ -111,6 +127,33 @@ data Frame
 
 type FrameInstance = (Key Frame,[(String,FId)])
 
+-- | The lexemes which occur in the same examples as ctxt_fun
+-- more often than expected, best first, with the log of the ratio.
+-- The table is computed by glosses.
+data Context
+  = Context
+      { ctxt_fun   :: Fun
+      , ctxt_items :: [(Fun,Float)]
+      }
+   deriving (Data,Show)
+
+-- | The statistics of the whole corpus. The table has a single row,
+-- computed by glosses, which SenseService reads once at startup.
+-- stat_bigrams is the number of ordered pairs of functions in the
+-- same example, which normalizes the ratios in the contexts table.
+-- The rest is for planning the pattern queries: the number of lexemes
+-- and synsets, and for every kind of pointer the number of lexeme
+-- and synset pointers of that kind.
+data CorpusStatistics
+  = CorpusStatistics
+      { stat_examples :: Int
+      , stat_bigrams  :: Int
+      , stat_lexemes  :: Int
+      , stat_synsets  :: Int
+      , stat_pointers :: [(PointerSymbol,(Int,Int))]
+      }
+   deriving (Data,Show)
+
 synsets :: Table Synset
 synsets = table "synsets"
 
@@ -162,3 +205,18 @@ frames = table "frames"
 
 frames_class :: Index Frame (Key Class)
 frames_class = index frames "super" class_id
+
+-- | The lexemes in every domain in ascending order. The key of
+-- a row is the key of the domain. The table is computed by glosses.
+domain_lexemes :: Table [Key Lexeme]
+domain_lexemes = table "domain_lexemes"
+
+corpus_statistics :: Table CorpusStatistics
+corpus_statistics = table "corpus_statistics"
+
+contexts :: Table Context
+contexts = table "contexts"
+             `withIndex` contexts_fun
+
+contexts_fun :: Index Context Fun
+contexts_fun = index contexts "fun" ctxt_fun
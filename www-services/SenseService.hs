@@ -4,37 +4,70 @@ import Database.Daison
 import SenseSchema
 import Interval
 import PatternMatching
+import SenseIndex
+import SynsetGraph
+import ResponseCache
+import JSONBuilder
 import qualified Data.Map as Map
 import qualified Data.Set as Set
-import qualified Data.Vector as Vector
-import Control.Monad(foldM,msum,forM_)
+import Control.Monad(msum,forM_,replicateM_)
 import Control.Concurrent(forkIO)
+import Control.Concurrent.Chan
+import Control.Exception(evaluate,bracket)
+import System.Timeout(timeout)
 import Network.CGI
 import Network.FastCGI(runFastCGI,runFastCGIConcurrent')
-import qualified Codec.Binary.UTF8.String as UTF8 (encodeString,decodeString)
+import qualified Data.ByteString as BS
+import qualified Data.ByteString.Lazy as BSL
+import qualified Data.ByteString.UTF8 as BSS
 import Text.JSON
 import Data.Maybe(mapMaybe, fromMaybe, catMaybes, isNothing)
 import Data.List(sortOn,sortBy,delete,intercalate,nub)
 import Data.Char
+import Data.Data(Data)
 
 main = do
-  db <- openDB (SERVER_PATH++"/semantics.db")
-  bigram_total <- runDaison db ReadOnlyMode $ do
-    query sumRows
-          [c*c
-             | (ex_id,(ex,_)) <- from examples everything
-             , let c = length (exprFunctions ex)]
--- #ifndef mingw32_HOST_OS
---                   runFastCGIConcurrent' forkIO 100 (cgiMain db)
--- #else
-  runFastCGI (handleErrors $ cgiMain db bigram_total)
--- #endif
-  closeDB db
+  -- every request which is served at the same time
+  -- has its own read-only handle to the database
+  db_pool <- newChan
+  replicateM_ maxRequests (openDB (SERVER_PATH++"/semantics.db") >>= writeChan db_pool)
+  -- a single row which glosses has computed
+  stats <- bracket (readChan db_pool) (writeChan db_pool) $ \db ->
+             runDaison db ReadOnlyMode $
+               fmap (foldr (const . snd) (CorpusStatistics 0 0 0 0 []))
+                    (select (from corpus_statistics everything))
+  synset_graph <- openSynsetGraph (SERVER_PATH++"/semantics.graph")
+  mb_index <- openSenseIndex (SERVER_PATH++"/embedding.bin") (SERVER_PATH++"/embedding.hnsw")
+  cache <- newResponseCache (SERVER_PATH++"/semantics.db") maxCacheSize
+#ifndef mingw32_HOST_OS
+  runFastCGIConcurrent' forkIO maxRequests (handleErrors $ cgiMain db_pool stats synset_graph mb_index cache)
+#else
+  runFastCGI (handleErrors $ cgiMain db_pool stats synset_graph mb_index cache)
+#endif
+  replicateM_ maxRequests (readChan db_pool >>= closeDB)
 
 maxResultLength = 500
 
-cgiMain :: Database -> Int -> CGI CGIResult
-cgiMain db bigram_total = do
+-- | At most that many requests are served at the same time,
+-- the rest wait for their turn.
+maxRequests = 16
+
+-- | In microseconds. A request which takes longer is answered
+-- with 503 so that it doesn't hold a slot forever.
+requestTimeout = 30*1000000
+
+-- | The estimated number of rows that a pattern may visit.
+-- A single scan over the lexemes is still allowed, but not
+-- a scan for every binding of another variable. This is only
+-- an estimate from the average fanouts. The real limits are
+-- maxResultLength and the request timeout.
+maxPatternCost = 5*1000000 :: Double
+
+-- | In bytes, for the responses of the cached queries
+maxCacheSize = 64*1024*1024
+
+cgiMain :: Chan Database -> CorpusStatistics -> SynsetGraph -> Maybe SenseIndex -> ResponseCache -> CGI CGIResult
+cgiMain db_pool stats synset_graph mb_index cache = do
   mb_s1 <- getInput "lexical_ids"
   mb_s2 <- getInput "context_id"
   mb_s3 <- getInput "gloss_id"
@@ -45,75 +78,101 @@ cgiMain db bigram_total = do
   mb_s10<- getInput "list_top_classes"
   mb_s11<- getInput "class_id"
   s12   <- fmap (\xs -> [value | ("pattern_match",value) <- xs]) getInputs
+  mb_s13<- getInput "similar_id"
+  mb_s14<- getInput "limit"
   case mb_s1 of
-    Just s  -> do json <- liftIO (doQuery (words s))
-                  outputJSONP json
+    Just s  -> runCachedQuery ("lexical_ids="++unwords (words s)) (doQuery (words s))
     Nothing -> case mb_s2 of
-                 Just lex_id -> do json <- liftIO (doContext lex_id (fromMaybe 4 (fmap read mb_s4)))
-                                   outputJSONP json
+                 Just lex_id -> runQuery (doContext lex_id (fromMaybe 4 (fmap read mb_s4)))
                  Nothing     -> case mb_s3 of
-                                  Just lex_id -> do json <- liftIO (doGloss lex_id)
-                                                    outputJSONP json
+                                  Just lex_id -> runCachedQuery ("gloss_id="++lex_id) (doGloss lex_id)
                                   Nothing     -> case mb_s7 of
-                                                   Just s  -> do json <- liftIO (doGeneralize (words s))
-                                                                 outputJSONP json
+                                                   Just s  -> runQuery (doGeneralize (words s))
                                                    Nothing -> case mb_s8 of
-                                                                Just _  -> do json <- liftIO doListDomains
-                                                                              outputJSONP json
+                                                                Just _  -> runCachedQuery "list_domains" doListDomains
                                                                 Nothing -> case map read s9 of
-                                                                             (d:ds) -> do json <- liftIO (doDomainQuery d ds)
-                                                                                          outputJSONP json
+                                                                             (d:ds) -> runQuery (doDomainQuery d ds)
                                                                              _      -> case mb_s10 of
-                                                                                         Just _  -> do json <- liftIO doListTopClasses
-                                                                                                       outputJSONP json
+                                                                                         Just _  -> runCachedQuery "list_top_classes" doListTopClasses
                                                                                          Nothing -> case mb_s11 of
-                                                                                                      Just id -> do json <- liftIO (doClassQuery (read id))
-                                                                                                                    outputJSONP json
+                                                                                                      Just id -> runQuery (doClassQuery (read id))
                                                                                                       Nothing -> case s12 of
                                                                                                                    _:_ -> do body <- getBody
                                                                                                                              case decode body of
-                                                                                                                               Ok pattern -> do json <- liftIO (doPatternMatch s12 pattern)
-                                                                                                                                                outputJSONP json
+                                                                                                                               Ok pattern -> runQuery (doPatternMatch s12 pattern)
                                                                                                                                Error msg   -> do fail msg
-                                                                                                                   []  -> outputNothing
+                                                                                                                   []  -> case mb_s13 of
+                                                                                                                            Just lex_id -> runQuery (doSimilar lex_id (readLimit mb_s14))
+                                                                                                                            Nothing     -> outputNothing
   where
+    -- Every query is a single read-only transaction. The result
+    -- is encoded within the time limit, since it is built lazily.
+    -- The strict ByteString is complete when it is evaluated.
+    runQuery :: JSON a => IO a -> CGI CGIResult
+    runQuery io = do
+      mb_json <- liftIO (timedQuery io)
+      case mb_json of
+        Just json -> outputEncodedJSONP json
+        Nothing   -> outputError 503 "The request took too long" []
+
+    -- The same, but the JSON is cached until the database changes,
+    -- and the browser can revalidate its copy with the ETag.
+    runCachedQuery :: JSON a => String -> IO a -> CGI CGIResult
+    runCachedQuery key io = do
+      ver <- liftIO (databaseVersion cache)
+      mc  <- getInput "jsonp"
+      let etag = responseETag ver (key ++ maybe "" ('\0':) mc)
+      setHeader "ETag" etag
+      setHeader "Cache-Control" "no-cache"
+      mb_tags <- requestHeader "If-None-Match"
+      if maybe False (matchETag etag) mb_tags
+        then do setStatus 304 "Not Modified"
+                setXO
+                outputNothing
+        else do mb_json <- liftIO (cachedResponse cache ver key (timedQuery io))
+                case mb_json of
+                  Just json -> outputEncodedJSONP json
+                  Nothing   -> outputError 503 "The request took too long" []
+      where
+        matchETag etag tags =
+          let ts = words (map (\c -> if c == ',' then ' ' else c) tags)
+          in elem "*" ts || elem etag ts
+
+    timedQuery io = timeout requestTimeout (io >>= evaluate . encodeJSON)
+
+    -- Daison doesn't promise that transactions on the same handle
+    -- can run in several threads at once, so every transaction takes
+    -- a handle from the pool and returns it afterwards, even if the
+    -- request times out. There are as many handles as requests.
+    readDB :: Daison a -> IO a
+    readDB t = bracket (readChan db_pool) (writeChan db_pool)
+                       (\db -> runDaison db ReadOnlyMode t)
+
     doQuery lex_ids = do
-      senses <- runDaison db ReadOnlyMode $
-                  foldM (getSense db) Map.empty lex_ids
+      senses <- readDB $ do
+                  lexemes <- select [row | lex_id <- anyOf lex_ids
+                                         , row <- fromIndex lexemes_fun (at lex_id)]
+                  getGlosses lexemes
       let sorted_senses = (sortSenses . Map.toList) senses
       return (makeObj [("total",     showJSON (length lex_ids))
                       ,("retrieved", showJSON (length lex_ids))
                       ,("result",    showJSON (map mkSenseObj sorted_senses))
                       ])
-      where
-        getSense db senses lex_id = do
-          lexemes <- select (fromIndex lexemes_fun (at lex_id))
-          foldM getGloss senses lexemes
 
     doContext lex_id depth = do
-      runDaison db ReadOnlyMode $ do
-        ctxt <- query (groupRowsWith (+) 0)
-                      [(lex_id', 1/(lex_prob lex * lex_prob lex' * fromIntegral bigram_total))
-                          | (_,lex) <- fromIndex lexemes_fun (at lex_id)
-                          , (ex_id,(ex,_)) <- fromIndex examples_fun (at lex_id)
-                          , lex_id' <- anyOf (exprFunctions ex)
-                          , lex_id' /= lex_id
-                          , (_,lex') <- fromIndex lexemes_fun (at lex_id')]
-                  `having` (\x -> x > 1)
+      readDB $ do
+        ctxt <- select [item | (_,c) <- fromIndex contexts_fun (at lex_id)
+                             , item <- anyOf (ctxt_items c)]
         synsets <- select [synset_id
                              | (_,lex) <- fromIndex lexemes_fun (at lex_id)
                              , Just synset_id <- return (synset lex)]
-        graph <- foldM (crawlGraph 0 depth) Map.empty synsets
-        return (makeObj [("context", showJSON (map mkFunProb (Map.toList ctxt)))
+        let graph = foldl (crawlGraph synset_graph 0 depth) Map.empty synsets
+        return (makeObj [("context", showJSON (map mkFunProb ctxt))
                         ,("synsets", showJSON synsets)
                         ,("graph",   makeObj [(show key,mkNode node) | (key,node) <- Map.toList graph])
                         ])
       where
-        dist v1 v2 = sqrt (Vector.sum (Vector.zipWith diff v1 v2))
-          where
-            diff x y = (x-y)^2
-
-        mkFunProb (fun,prob) = makeObj [("mod", showJSON fun),("prob", showJSON (log prob))]
+        mkFunProb (fun,prob) = makeObj [("mod", showJSON fun),("prob", showJSON prob)]
 
         mkNode (gloss,funs,ptrs,dist) =
           makeObj [("gloss",showJSON gloss)
@@ -122,56 +181,70 @@ cgiMain db bigram_total = do
                   ,("dist", showJSON dist)
                   ]
 
+    doSimilar lex_id Nothing      =
+      return (makeObj [("error", showJSON "The limit must be a number")])
+    doSimilar lex_id (Just limit) =
+      case mb_index of
+        Just index -> do similar <- similarLexemes index lex_id limit
+                         return (showJSON (map mkSimilar similar))
+        Nothing    -> fail "The similarity index is not available"
+      where
+        mkSimilar (lex_id,dist) = makeObj [("lex_id", showJSON lex_id),("dist", showJSON dist)]
+
+    -- The default is 10 and the limit is clamped to 1..maxResultLength
+    readLimit Nothing  = Just 10
+    readLimit (Just s) =
+      case reads s :: [(Int,String)] of
+        [(k,rest)] | all isSpace rest -> Just (max 1 (min maxResultLength k))
+        _                             -> Nothing
+
     doGloss lex_id = do
-      glosses <- runDaison db ReadOnlyMode $
+      glosses <- readDB $
                     select [gloss s | (_,lex@(Lexeme{synset=Just synset_id})) <- fromIndex lexemes_fun (at lex_id),
                                       s <- from synsets (at synset_id)]
       return (showJSON glosses)
 
-    doGeneralize ids = do
-      x <- runDaison db ReadOnlyMode $ fmap catMaybes $ do
-         select [synset lexeme | fun <- anyOf ids,
-                                 (_,lexeme) <- fromIndex lexemes_fun (at fun)]
-
-      let up synset_id =
-            runDaison db ReadOnlyMode $ fmap head $ do
-              select [[id | (rel,id) <- pointers s
-                          , elem rel [Hypernym, InstanceHypernym]]
-                              | s <- from synsets (at synset_id)]
-
-      ids <- findLCA up (nub x)
-
-      fs <- runDaison db ReadOnlyMode $ do
-               select [(synset_id,(gloss,lex_ids))
-                          | int <- query (foldRows intersection [(0,maxBound-1)])
-                                         [children s | synset_id <- anyOf ids,
-                                                       s <- from synsets (at synset_id)],
-                            size int < 2000,
-                            (s,e) <- anyOf int,
-                            (synset_id,Synset offset _ _ gloss) <- from synsets (asc ^>= s ^<= e),
-                            lex_ids <- select [(lex_id,status,frame_inf,Just (domains,images,examples,sexamples,ptrs))
-                                                   | (_,Lexeme lex_id _ status _ domain_ids images ex_ids fs ptrs0) <- fromIndex lexemes_synset (at synset_id),
-                                                     domains   <- select [makeObj [ ("id",showJSON domain_id)
-                                                                                  , ("name",showJSON (domain_name d))
-                                                                                  ]
-                                                                            | domain_id <- anyOf domain_ids
-                                                                            , d <- from domains (at domain_id)],
-                                                     examples  <- select [ex | ex_id <- anyOf ex_ids, ex <- from examples (at ex_id)],
-                                                     sexamples <- select [ex | (id,ex) <- fromIndex examples_fun (at lex_id), not (elem id ex_ids)],
-                                                     ptrs <- select [(sym,lex_fun lex,SenseSchema.status lex) | (sym,id) <- anyOf ptrs0, lex <- from lexemes (at id)],
-                                                     frame_inf <- select [(name cls,base_class_id f,(frame_id,pattern f,semantics f,Nothing))
-                                                                            | frame_id <- anyOf fs
-                                                                            , f <- from frames (at frame_id)
-                                                                            , cls <- from classes (at (base_class_id f))]
-                                                   ]]
-
-      return  (makeObj [("concepts",  showJSON ids)
-                       ,("result",    showJSON (map mkSenseObj fs))
-                       ])
+    doGeneralize ids =
+      readDB $ do
+        x <- fmap catMaybes $ do
+           select [synset lexeme | fun <- anyOf ids,
+                                   (_,lexeme) <- fromIndex lexemes_fun (at fun)]
+
+        let up = return . synsetHypernyms synset_graph
+
+        ids <- findLCA up (nub x)
+
+        fs <- do
+                 select [(synset_id,(gloss,lex_ids))
+                            | int <- query (foldRows intersection [(0,maxBound-1)])
+                                           [children s | synset_id <- anyOf ids,
+                                                         s <- from synsets (at synset_id)],
+                              size int < 2000,
+                              (s,e) <- anyOf int,
+                              (synset_id,Synset offset _ _ gloss) <- from synsets (asc ^>= s ^<= e),
+                              lex_ids <- select [(lex_id,status,frame_inf,Just (domains,images,examples,sexamples,ptrs))
+                                                     | (_,Lexeme lex_id _ status _ domain_ids images ex_ids fs ptrs0) <- fromIndex lexemes_synset (at synset_id),
+                                                       domains   <- select [makeObj [ ("id",showJSON domain_id)
+                                                                                    , ("name",showJSON (domain_name d))
+                                                                                    ]
+                                                                              | domain_id <- anyOf domain_ids
+                                                                              , d <- from domains (at domain_id)],
+                                                       examples  <- select [ex | ex_id <- anyOf ex_ids, ex <- from examples (at ex_id)],
+                                                       sexamples <- select [ex | (id,ex) <- fromIndex examples_fun (at lex_id), not (elem id ex_ids)],
+                                                       ptrs <- select [(sym,lex_fun lex,SenseSchema.status lex) | (sym,id) <- anyOf ptrs0, lex <- from lexemes (at id)],
+                                                       frame_inf <- select [(name cls,base_class_id f,(frame_id,pattern f,semantics f,Nothing))
+                                                                              | frame_id <- anyOf fs
+                                                                              , f <- from frames (at frame_id)
+                                                                              , cls <- from classes (at (base_class_id f))]
+                                                     ]]
+
+        return  (makeObj [("concepts",  showJSON ids)
+                         ,("result",    showJSON (map mkSenseObj fs))
+                         ])
 
 
     doListDomains =
-      runDaison db ReadOnlyMode $ do
+      readDB $ do
         roots <- listDomains 0
         return (showJSON roots)
       where
@@ -186,24 +259,25 @@ cgiMain db bigram_total = do
                      ]
 
     doDomainQuery d ds = do
-      runDaison db ReadOnlyMode $ do
-        lexemes0 <- select [res | res@(_,lexeme) <- fromIndex lexemes_domain (at d),
-                                  all (flip elem (domain_ids lexeme)) ds]
-        let lexemes1 = take maxResultLength lexemes0
-        senses <- foldM getGloss Map.empty lexemes1
+      readDB $ do
+        postings <- mapM (\domain_id -> fmap concat (select (from domain_lexemes (at domain_id)))) (d:ds)
+        let keys0 = intersectPostings postings
+        lexemes1 <- select [(id,lexeme) | id <- anyOf (take maxResultLength keys0)
+                                        , lexeme <- from lexemes (at id)]
+        senses <- getGlosses lexemes1
         let sorted_senses = (sortSenses . Map.toList) senses
-        return (makeObj [("total",     showJSON (length lexemes0))
+        return (makeObj [("total",     showJSON (length keys0))
                         ,("retrieved", showJSON (length lexemes1))
                         ,("result",    showJSON (map mkSenseObj sorted_senses))
                         ])
 
     doListTopClasses = do
-      x <- runDaison db ReadOnlyMode $ do
+      x <- readDB $ do
          select [(id,name cls) | (id,cls) <- from classes everything, isNothing (super_id cls)]
       return (showJSON x)
       
     doClassQuery id = do
-      x <- runDaison db ReadOnlyMode $ do
+      x <- readDB $ do
          select [mkClassObj cls frames subclasses
                    | cls <- from classes (at id),
                      frames <- select (getFrames id),
@@ -223,42 +297,67 @@ cgiMain db bigram_total = do
                lexemes <- select (fromIndex lexemes_frame (at id))]
 
     doPatternMatch vars pattern = do
-      res <- runDaison db ReadOnlyMode $ do
-               select [makeObj [(var,mkSenseObj (binding2obj value))
-                                    | var <- vars
-                                    , Just value <- [Map.lookup var env]]
-                          | env <- matchPattern pattern]
-      return (showJSON res)
+      let (cost,plan) = planPattern stats pattern
+      mb_res <- if cost > maxPatternCost
+                  then return Nothing
+                  else fmap Just (readDB (matchPattern maxResultLength plan))
+      case mb_res of
+        Just envs -> return (showJSON [makeObj [(var,mkSenseObj (binding2obj value))
+                                                  | var <- vars
+                                                  , Just value <- [Map.lookup var env]]
+                                         | env <- envs])
+        Nothing   -> fail "The pattern is too expensive to match. Please bind more of its variables."
       where
         binding2obj (LexemeValue _ lexeme mb_synset) =
           (fromMaybe 0 (synset lexeme),(maybe "" gloss mb_synset,[(lex_fun lexeme,status lexeme,[],Nothing)]))
         binding2obj (SynsetValue key synset lexemes) =
           (key,(gloss synset,[(lex_fun lexeme,status lexeme,[],Nothing) | (_,lexeme) <- lexemes]))
 
-    getGloss senses (_,Lexeme lex_id _ status mb_sense_id domain_ids images ex_ids _ ptrs0) = do
-      domains   <- select [makeObj [ ("id",showJSON domain_id)
-                                   , ("name",showJSON (domain_name d))
-                                   ]
-                               | domain_id <- anyOf domain_ids
-                               , d <- from domains (at domain_id)]
-      examples  <- select [ex | ex_id <- anyOf ex_ids, ex <- from examples (at ex_id)]
-      sexamples <- select [ex | (id,ex) <- fromIndex examples_fun (at lex_id), not (elem id ex_ids)]
-
-      ptrs <- select [(sym,lex_fun lex,SenseSchema.status lex) | (sym,id) <- anyOf ptrs0, lex <- from lexemes (at id)]
-
-      case mb_sense_id of
-        Just sense_id -> 
-          case Map.lookup sense_id senses of
-            Just (gloss,lex_ids) -> return (Map.insert sense_id (gloss,addInfo lex_id (domains,images,examples,sexamples,ptrs) lex_ids) senses)
-            Nothing              -> do [Synset _ _ _ gloss] <- select (from synsets (at sense_id))
-                                       lex_ids <- select [(lex_id,status,frame_inf,Nothing)
-                                                              | (_,Lexeme lex_id _ status _ _ _ _ fs _) <- fromIndex lexemes_synset (at sense_id),
-                                                                frame_inf <- select [(name cls,base_class_id f,(frame_id,pattern f,semantics f,Nothing))
-                                                                                          | frame_id <- anyOf fs
-                                                                                          , f <- from frames (at frame_id)
-                                                                                          , cls <- from classes (at (base_class_id f))]]
-                                       return (Map.insert sense_id (gloss,addInfo lex_id (domains,images,examples,sexamples,ptrs) lex_ids) senses)
-        Nothing -> return (Map.insert (fromIntegral (5000000+Map.size senses)) ("",[(lex_id,status,[],Just (domains,images,examples,sexamples,ptrs))]) senses)
+    -- The senses of the lexemes together with the other lexemes
+    -- in the same synsets. Every table is read only once, with
+    -- the keys of all lexemes in ascending order, and the result
+    -- is put together afterwards.
+    getGlosses lexemes = do
+      let lexemes' = map snd lexemes
+      domain_rows   <- fetchRows domains  (concatMap domain_ids lexemes')
+      example_rows  <- fetchRows examples (concatMap example_ids lexemes')
+      sexample_rows <- fetchIndex examples_fun (map lex_fun lexemes')
+      pointer_rows  <- fetchRows lexemes  [id | lex <- lexemes', (_,id) <- lex_pointers lex]
+      let synset_ids = [synset_id | lex <- lexemes', Just synset_id <- [synset lex]]
+      synset_rows   <- fetchRows synsets synset_ids
+      sibling_rows  <- fetchIndex lexemes_synset synset_ids
+      frame_rows    <- fetchRows frames [frame_id | rows <- Map.elems sibling_rows, (_,lex) <- rows, frame_id <- frame_ids lex]
+      class_rows    <- fetchRows classes (map base_class_id (Map.elems frame_rows))
+
+      let getInfo (Lexeme lex_id _ _ _ domain_ids images ex_ids _ ptrs0) =
+            let domains   = [makeObj [ ("id",showJSON domain_id)
+                                     , ("name",showJSON (domain_name d))
+                                     ]
+                               | domain_id <- domain_ids
+                               , Just d <- [Map.lookup domain_id domain_rows]]
+                examples  = mapMaybe (flip Map.lookup example_rows) ex_ids
+                sexamples = [ex | (id,ex) <- Map.findWithDefault [] lex_id sexample_rows, not (elem id ex_ids)]
+                ptrs      = [(sym,lex_fun lex,SenseSchema.status lex) | (sym,id) <- ptrs0, Just lex <- [Map.lookup id pointer_rows]]
+            in (domains,images,examples,sexamples,ptrs)
+
+          getSiblings sense_id =
+            [(lex_id,status,frame_inf,Nothing)
+                | (_,Lexeme lex_id _ status _ _ _ _ fs _) <- Map.findWithDefault [] sense_id sibling_rows,
+                  let frame_inf = [(name cls,base_class_id f,(frame_id,pattern f,semantics f,Nothing))
+                                      | frame_id <- fs
+                                      , Just f <- [Map.lookup frame_id frame_rows]
+                                      , Just cls <- [Map.lookup (base_class_id f) class_rows]]]
+
+          addGloss senses lex@(Lexeme{lex_fun=lex_id,synset=mb_sense_id}) =
+            case mb_sense_id of
+              Just sense_id ->
+                case Map.lookup sense_id senses of
+                  Just (gloss,lex_ids) -> Map.insert sense_id (gloss,addInfo lex_id (getInfo lex) lex_ids) senses
+                  Nothing              -> let gloss = maybe "" SenseSchema.gloss (Map.lookup sense_id synset_rows)
+                                          in Map.insert sense_id (gloss,addInfo lex_id (getInfo lex) (getSiblings sense_id)) senses
+              Nothing -> Map.insert (fromIntegral (5000000+Map.size senses)) ("",[(lex_id,SenseSchema.status lex,[],Just (getInfo lex))]) senses
+
+      return (foldl addGloss Map.empty lexemes')
       where
         addInfo lex_id info lex_ids = 
           [(lex_id',status,frames,if lex_id == lex_id' then Just info else mb_info)
@@ -331,6 +430,35 @@ cgiMain db bigram_total = do
                  Just funs -> [("fun", showJSON (funs :: [String]))]
               )
 
+-- | Reads the rows with the given keys, each of them once
+-- and in ascending order
+fetchRows :: Data a => Table a -> [Key a] -> Daison (Map.Map (Key a) a)
+fetchRows tbl keys =
+  fmap Map.fromList $
+    select [(key,row) | key <- anyOf (Set.toAscList (Set.fromList keys))
+                      , row <- from tbl (at key)]
+
+-- | The same for an index. The rows for every value are
+-- in the order of the index.
+fetchIndex :: (Data a, Data b, Ord b) => Index a b -> [b] -> Daison (Map.Map b [(Key a,a)])
+fetchIndex idx values =
+  fmap (Map.map reverse . Map.fromListWith (++)) $
+    select [(value,[row]) | value <- anyOf (Set.toAscList (Set.fromList values))
+                          , row <- fromIndex idx (at value)]
+
+-- | The intersection of ascending lists of keys, merged two at
+-- a time. Daison decodes every list as a whole, so reading them is
+-- linear in their total length anyway, and so is the merge.
+intersectPostings :: [[Key Lexeme]] -> [Key Lexeme]
+intersectPostings []       = []
+intersectPostings (ps:pss) = foldl merge ps pss
+  where
+    merge xs@(x:xs') ys@(y:ys')
+      | x < y     = merge xs' ys
+      | x > y     = merge xs  ys'
+      | otherwise = x : merge xs' ys'
+    merge _  _ = []
+
 findLCA :: (Monad m, Ord a) => (a -> m [a]) -> [a] -> m [a]
 findLCA up xs = alternate [([x],[]) | x <- xs] [] [] Map.empty
   where
@@ -358,26 +486,21 @@ findLCA up xs = alternate [([x],[]) | x <- xs] [] [] Map.empty
 
 type Graph   = Map.Map (Key Synset) (String,[Fun],[(PointerSymbol,Key Synset)],Int)
 
-crawlGraph :: Int -> Int -> Graph -> Key Synset -> Daison Graph
-crawlGraph dist depth graph synset_id
+crawlGraph :: SynsetGraph -> Int -> Int -> Graph -> Key Synset -> Graph
+crawlGraph synset_graph dist depth graph synset_id
   | Map.member synset_id graph
-                  = return (updateDepth graph)
-  | dist >= depth = do details <- getDetails False synset_id
-                       return (addDetails details graph)
-  | otherwise     = do details@(gloss,funs,ptrs,_) <- getDetails True synset_id
-                       foldM (crawlGraph (dist+1) depth) (addDetails details graph) (map snd ptrs)
+                  = updateDepth graph
+  | dist >= depth = addDetails (getDetails False) graph
+  | otherwise     = let details@(gloss,funs,ptrs,_) = getDetails True
+                    in foldl (crawlGraph synset_graph (dist+1) depth) (addDetails details graph) (map snd ptrs)
   where
-    getDetails use_new synset_id = do
-      (gloss,ptrs) <- query firstRow
-                          [( gloss synset
-                           , [ptr | ptr@(sym,tgt) <- pointers synset
-                                  , match synset_id tgt]
-                           )
-                              | synset <- from synsets (at synset_id)
-                              ]
-      funs <- select [lex_fun lex
-                        | (_,lex) <- fromIndex lexemes_synset (at synset_id)]
-      return (gloss,funs,ptrs,dist)
+    getDetails use_new =
+      ( synsetGloss synset_graph synset_id
+      , synsetLexemes synset_graph synset_id
+      , [ptr | ptr@(sym,tgt) <- synsetPointers synset_graph synset_id
+             , match synset_id tgt]
+      , dist
+      )
       where
         match src tgt =
           case Map.lookup tgt graph of
@@ -389,23 +512,22 @@ crawlGraph dist depth graph synset_id
     updateDepth graph = Map.adjust (\(gloss,funs,ptrs,_) -> (gloss,funs,ptrs,dist)) synset_id graph
 
 outputJSONP :: JSON a => a -> CGI CGIResult
-outputJSONP = outputEncodedJSONP . encode
+outputJSONP = outputEncodedJSONP . encodeJSON
 
-outputEncodedJSONP :: String -> CGI CGIResult
+-- | The JSON is already encoded in UTF-8
+outputEncodedJSONP :: BS.ByteString -> CGI CGIResult
 outputEncodedJSONP json = 
     do mc <- getInput "jsonp"
-       let (ty,str) = case mc of
-                        Nothing -> ("json",json)
-                        Just c  -> ("javascript",c ++ "(" ++ json ++ ")")
+       let (ty,bs) = case mc of
+                       Nothing -> ("json",json)
+                       Just c  -> ("javascript",BS.concat [BSS.fromString (c ++ "("), json, BSS.fromString ")"])
            ct = "application/"++ty++"; charset=utf-8"
-       outputText ct str
-
-outputText ct = outputStrict ct . UTF8.encodeString
+       outputBytes ct bs
 
-outputStrict :: String -> String -> CGI CGIResult
-outputStrict ct x = do setHeader "Content-Type" ct
-                       setHeader "Content-Length" (show (length x))
-                       setXO
-                       output x
+outputBytes :: String -> BS.ByteString -> CGI CGIResult
+outputBytes ct x = do setHeader "Content-Type" ct
+                      setHeader "Content-Length" (show (BS.length x))
+                      setXO
+                      outputFPS (BSL.fromStrict x)
 
 setXO = setHeader "Access-Control-Allow-Origin" "*"
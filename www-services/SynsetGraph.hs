@@ -0,0 +1,78 @@
+{-# LANGUAGE ForeignFunctionInterface #-}
+module SynsetGraph(SynsetGraph, openSynsetGraph,
+                   synsetGloss, synsetPointers, synsetLexemes,
+                   synsetHypernyms) where
+
+import PGF2(Fun)
+import Database.Daison(Key)
+import SenseSchema
+import Data.Array(Array,listArray,(!))
+import Foreign
+import Foreign.C
+import qualified GHC.Foreign as GHC
+import GHC.IO.Encoding(utf8)
+import System.IO.Unsafe(unsafeDupablePerformIO)
+
+-- | The synsets with their pointers and lexemes, in compressed
+-- rows indexed by the synset key. build/glosses writes them
+-- to semantics.graph, and the file is mapped at startup, so the
+-- service does not read the synsets before serving. The mapped
+-- memory is never written, so the lookups are pure.
+newtype SynsetGraph = SynsetGraph (Ptr ())
+
+-- | Maps the graph which build/glosses has written
+openSynsetGraph :: FilePath -> IO SynsetGraph
+openSynsetGraph fpath =
+  withCString fpath $ \c_fpath -> do
+    ptr <- synset_graph_load c_fpath
+    if ptr == nullPtr
+      then fail ("Cannot open "++fpath)
+      else return (SynsetGraph ptr)
+
+synsetGloss :: SynsetGraph -> Key Synset -> String
+synsetGloss (SynsetGraph ptr) key = unsafeDupablePerformIO $
+  synset_graph_gloss ptr (fromIntegral key) >>= GHC.peekCString utf8
+
+synsetPointers :: SynsetGraph -> Key Synset -> [(PointerSymbol,Key Synset)]
+synsetPointers (SynsetGraph ptr) key = unsafeDupablePerformIO $
+  alloca $ \c_tags ->
+  alloca $ \c_targets -> do
+    n       <- synset_graph_pointers ptr (fromIntegral key) c_tags c_targets
+    tags    <- peek c_tags    >>= peekArray (fromIntegral n)
+    targets <- peek c_targets >>= peekArray (fromIntegral n)
+    return [(symbols ! tag, fromIntegral target) | (tag,target) <- zip tags targets]
+
+synsetHypernyms :: SynsetGraph -> Key Synset -> [Key Synset]
+synsetHypernyms (SynsetGraph ptr) key = unsafeDupablePerformIO $
+  alloca $ \c_targets -> do
+    n <- synset_graph_hypernyms ptr (fromIntegral key) c_targets
+    fmap (map fromIntegral) (peek c_targets >>= peekArray (fromIntegral n))
+
+synsetLexemes :: SynsetGraph -> Key Synset -> [Fun]
+synsetLexemes (SynsetGraph ptr) key = unsafeDupablePerformIO $
+  alloca $ \c_first -> do
+    n     <- synset_graph_lexemes ptr (fromIntegral key) c_first
+    first <- peek c_first
+    mapM (\i -> synset_graph_fun ptr i >>= GHC.peekCString utf8)
+         (take (fromIntegral n) [first..])
+
+symbols :: Array Word8 PointerSymbol
+symbols = listArray (0,fromIntegral (length pointerSymbols-1)) pointerSymbols
+
+foreign import ccall "synset_graph.h synset_graph_load"
+  synset_graph_load :: CString -> IO (Ptr ())
+
+foreign import ccall unsafe "synset_graph.h synset_graph_gloss"
+  synset_graph_gloss :: Ptr () -> CSize -> IO CString
+
+foreign import ccall unsafe "synset_graph.h synset_graph_pointers"
+  synset_graph_pointers :: Ptr () -> CSize -> Ptr (Ptr Word8) -> Ptr (Ptr Word32) -> IO CSize
+
+foreign import ccall unsafe "synset_graph.h synset_graph_hypernyms"
+  synset_graph_hypernyms :: Ptr () -> CSize -> Ptr (Ptr Word32) -> IO CSize
+
+foreign import ccall unsafe "synset_graph.h synset_graph_lexemes"
+  synset_graph_lexemes :: Ptr () -> CSize -> Ptr CSize -> IO CSize
+
+foreign import ccall unsafe "synset_graph.h synset_graph_fun"
+  synset_graph_fun :: Ptr () -> CSize -> IO CString
@@ -4,14 +4,18 @@ import Database.Daison
 import SenseSchema
 import ContentSchema
 import Data.Char
-import Data.List(partition,intercalate)
+import Data.List(partition,intercalate,nub,sort,sortOn)
 import Data.Maybe
 import Data.Either
 import Data.Data
 import Data.Tree
 import System.Directory
+import System.IO
 import Control.Monad
 import qualified Data.Map.Strict as Map
+import qualified Data.ByteString as BS
+import qualified Data.ByteString.UTF8 as BSS
+import qualified Data.ByteString.Builder as BB
 import Debug.Trace
 
 main = do
@@ -100,8 +104,34 @@ main = do
                                              , id <- from lexemes_fun (at fun)]
                          ]
 
+    createTable domain_lexemes
+    postings <- select [(domain_id,[id])
+                          | (id,lex) <- from lexemes everything
+                          , domain_id <- anyOf (domain_ids lex)]
+    forM_ (Map.toList (Map.fromListWith (++) postings)) $ \(domain_id,ids) ->
+      store domain_lexemes (Just domain_id) (sort ids)
+
+    createTable contexts
+    exs <- select [exprFunctions ex | (_,(ex,_)) <- from examples everything]
+    let lex_probs    = Map.fromList [(fun,fromMaybe 0 (Map.lookup fun probs)) | (_,fun,_,_) <- absdefs]
+        bigram_total = sum [length fs * length fs | fs <- exs]
+    forM_ (contextTable lex_probs bigram_total exs) $ \(fun,items) ->
+      insert_ contexts (Context fun items)
+
+    createTable corpus_statistics
+    lex_syms <- select [map fst (lex_pointers lex) | (_,lex) <- from lexemes everything]
+    syn_syms <- select [map fst (pointers synset) | (_,synset) <- from synsets everything]
+    let add (l1,s1) (l2,s2) = (l1+l2,s1+s2)
+        counts = Map.fromListWith add ([(sym,(1,0)) | syms <- lex_syms, sym <- syms] ++
+                                       [(sym,(0,1)) | syms <- syn_syms, sym <- syms])
+    insert_ corpus_statistics (CorpusStatistics (length exs) bigram_total
+                                                (length lex_syms) (length syn_syms)
+                                                (Map.toList counts))
+
     createTable updates
 
+  writeSynsetGraph db "semantics.graph"
+
   cs <- runDaison db ReadOnlyMode $ 
           query (foldRows accumCounts Map.empty) $ 
             [(drop 5 lang,status)
@@ -111,6 +141,77 @@ main = do
 
   closeDB db
 
+-- | Writes the synsets with their pointers and lexemes in the layout
+-- of train/synset_graph.h. SenseService maps the file, so it is
+-- replaced rather than overwritten.
+writeSynsetGraph db fpath = do
+  (ss,ls) <- runDaison db ReadOnlyMode $ do
+    ss <- select (from synsets everything)
+    ls <- select [(synset_id,[lex_fun lex])
+                    | (_,lex) <- from lexemes everything
+                    , Just synset_id <- return (synset lex)]
+    return (ss,ls)
+
+  let synset_map = Map.fromList ss
+      lex_map    = Map.map reverse (Map.fromListWith (++) ls)
+      keys       = [0 .. maximum (0 : Map.keys synset_map ++ Map.keys lex_map)]
+      rows       = [(maybe [] pointers mb_synset
+                    ,maybe "" gloss mb_synset
+                    ,Map.findWithDefault [] key lex_map)
+                      | key <- keys, let mb_synset = Map.lookup key synset_map]
+      ptrs       = [ps | (ps,_,_) <- rows]
+      hyps       = [[tgt | (sym,tgt) <- ps, elem sym [Hypernym,InstanceHypernym]] | ps <- ptrs]
+      lexs       = [fs | (_,_,fs) <- rows]
+      gloss_strs = [BSS.fromString g | (_,g,_) <- rows]
+      fun_strs   = [BSS.fromString f | fs <- lexs, f <- fs]
+
+      header     = BB.word32Host 0x31475953 <>
+                   BB.word32Host (fromIntegral (length keys)) <>
+                   word64s [sum (map length ptrs), sum (map length hyps), length fun_strs,
+                            stringsSize gloss_strs, stringsSize fun_strs]
+
+      offsets xss     = scanl (+) 0 (map length xss)
+      stringOffsets bss = init (scanl (+) 0 [BS.length bs+1 | bs <- bss])
+      stringsSize bss = sum [BS.length bs+1 | bs <- bss]
+      strings bss     = mconcat [BB.byteString bs <> BB.word8 0 | bs <- bss]
+      word32s xs      = mconcat [BB.word32Host (fromIntegral x) | x <- xs]
+      word64s xs      = mconcat [BB.word64Host (fromIntegral x) | x <- xs]
+
+  let tmp_fpath = fpath++".tmp"
+  withBinaryFile tmp_fpath WriteMode $ \h ->
+    BB.hPutBuilder h (header <>
+                      word64s (stringOffsets gloss_strs) <>
+                      word64s (stringOffsets fun_strs) <>
+                      word32s (offsets ptrs) <> word32s [tgt | ps <- ptrs, (_,tgt) <- ps] <>
+                      word32s (offsets hyps) <> word32s (concat hyps) <>
+                      word32s (offsets lexs) <>
+                      mconcat [BB.word8 (pointerTag sym) | ps <- ptrs, (sym,_) <- ps] <>
+                      strings gloss_strs <>
+                      strings fun_strs)
+  renameFile tmp_fpath fpath
+
+maxContextSize = 200
+
+-- The number of examples with both lexemes divided by the number
+-- expected from their probabilities. Only the pairs with a ratio
+-- above one are kept, and at most maxContextSize per lexeme.
+contextTable lex_probs bigram_total exs =
+  [(fun,take maxContextSize (sortOn (negate . snd) items))
+     | (fun,counts) <- Map.toList pair_counts
+     , Just p <- [Map.lookup fun lex_probs]
+     , let items = [(fun',log ratio)
+                      | (fun',count) <- Map.toList counts
+                      , Just p' <- [Map.lookup fun' lex_probs]
+                      , let ratio = fromIntegral count / (p * p' * total)
+                      , ratio > 1]
+     , not (null items)]
+  where
+    total = fromIntegral bigram_total :: Float
+
+    pair_counts =
+      Map.fromListWith (Map.unionWith (+))
+        [(fun,Map.singleton fun' (1 :: Int)) | fs <- exs, fun <- nub fs, fun' <- fs, fun' /= fun]
+
 parseAbsSyn l =
   case words l of
     ("fun":fn:_) -> case break (=='\t') l of
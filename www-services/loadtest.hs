@@ -0,0 +1,87 @@
+import Network.HTTP.Client
+import Network.HTTP.Types.Status(statusCode)
+import Control.Concurrent
+import Control.Exception
+import Control.Monad
+import Data.List(sort,isPrefixOf)
+import Data.Maybe
+import GHC.Clock(getMonotonicTime)
+import System.Environment
+import System.Exit
+import System.IO
+import Text.Printf
+
+-- Replays a log of requests against a running SenseService and
+-- reports the latencies. Every line of the log is either a query
+-- string or a line from the access log of the web server, from which
+-- the query string of the GET request is taken. For example:
+--
+--   loadtest http://localhost/SenseService.fcgi requests.log 16
+--
+-- The last argument is the number of clients sending requests
+-- at the same time.
+
+main = do
+  args <- getArgs
+  (url,log_path,n_clients) <-
+     case args of
+       [url,log_path]   -> return (url,log_path,8)
+       [url,log_path,n] -> return (url,log_path,read n)
+       _                -> do hPutStrLn stderr "Syntax: loadtest <service url> <request log> [clients]"
+                              exitFailure
+  qs <- fmap (mapMaybe queryString . lines) (readFile log_path)
+
+  man     <- newManager defaultManagerSettings{managerConnCount=n_clients}
+  queue   <- newMVar qs
+  results <- newMVar []
+  done    <- newEmptyMVar
+  start   <- getMonotonicTime
+  forM_ [1..n_clients] $ \_ ->
+    forkIO (client man url queue results `finally` putMVar done ())
+  replicateM_ n_clients (takeMVar done)
+  end     <- getMonotonicTime
+
+  readMVar results >>= report (end-start)
+
+client man url queue results = loop
+  where
+    loop = do
+      mb_q <- modifyMVar queue (\qs -> return (drop 1 qs, listToMaybe qs))
+      case mb_q of
+        Nothing -> return ()
+        Just q  -> do req <- parseRequest (url++"?"++q)
+                      t0  <- getMonotonicTime
+                      res <- try (fmap (statusCode . responseStatus) (httpLbs req man))
+                      t1  <- getMonotonicTime
+                      let ok = either (\e -> const False (e :: SomeException)) (< 400) res
+                      modifyMVar_ results (return . ((t1-t0,ok):))
+                      loop
+
+report :: Double -> [(Double,Bool)] -> IO ()
+report elapsed results = do
+  let latencies = sort (map fst results)
+      n         = length latencies
+      n_errors  = length (filter (not . snd) results)
+  printf "%d requests, %d errors, %.1f requests/s\n" n n_errors (fromIntegral n / elapsed)
+  when (n > 0) $
+    printf "latency p50 %.1f ms, p99 %.1f ms, max %.1f ms\n"
+           (1000 * percentile 0.50 latencies)
+           (1000 * percentile 0.99 latencies)
+           (1000 * last latencies)
+  where
+    percentile :: Double -> [Double] -> Double
+    percentile p xs = xs !! max 0 (ceiling (p * fromIntegral (length xs)) - 1)
+
+queryString l =
+  case dropWhile (/= "\"GET") ws of
+    (_:path:_) -> afterMark path
+    _          -> case ws of
+                    [w] | not ("#" `isPrefixOf` w) -> Just (fromMaybe w (afterMark w))
+                    _                              -> Nothing
+  where
+    ws = words l
+
+    afterMark s =
+      case break (=='?') s of
+        (_,'?':q) -> Just q
+        _         -> Nothing